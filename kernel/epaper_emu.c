@@ -0,0 +1,618 @@
+/**
+ * Bench stand-in for an SSD1608-class panel. Registers a fake SPI
+ * controller and a three line GPIO chip (BUSY, DC, RESET) with an
+ * "epaper_spi" device on it, so the driver binds exactly as it does on
+ * a board. Every transfer is decoded against a small controller model
+ * (RAM, address window and counters, deep sleep), BUSY is held for the
+ * modelled reset and refresh times and traffic is counted in debugfs,
+ * which lets driver changes be benchmarked in a VM. The last transfers
+ * are kept in a small log ("log" in debugfs) for checking what the
+ * driver actually put on the wire. The panel geometry and dc-9bit are
+ * handed to the driver as device properties, as a DT node would.
+ */
+#include <linux/module.h>
+#include <linux/device.h>
+#include <linux/slab.h>
+#include <linux/spi/spi.h>
+#include <linux/gpio/driver.h>
+#include <linux/gpio/machine.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/delay.h>
+#include <linux/property.h>
+
+#define EMU_GPIO_BUSY   0
+#define EMU_GPIO_DC     1
+#define EMU_GPIO_RESET  2
+#define EMU_NGPIO       3
+
+#define EMU_LABEL       "epaper-emu"
+
+/* transfer log: entries kept, and leading bytes kept per entry */
+#define EMU_LOG_SIZE    256
+#define EMU_LOG_BYTES   16
+
+/* the part of the controller command set the model decodes */
+#define DEEP_SLEEP_MODE                             0x10
+#define DATA_ENTRY_MODE_SETTING                     0x11
+#define MASTER_ACTIVATION                           0x20
+#define WRITE_RAM                                   0x24
+#define READ_RAM                                    0x27
+#define WRITE_LUT_REGISTER                          0x32
+#define SET_RAM_X_ADDRESS_START_END_POSITION        0x44
+#define SET_RAM_Y_ADDRESS_START_END_POSITION        0x45
+#define SET_RAM_X_ADDRESS_COUNTER                   0x4E
+#define SET_RAM_Y_ADDRESS_COUNTER                   0x4F
+
+static unsigned width = 200;
+module_param(width, uint, S_IRUGO);
+static unsigned height = 200;
+module_param(height, uint, S_IRUGO);
+static bool dc_9bit;
+module_param(dc_9bit, bool, S_IRUGO);
+MODULE_PARM_DESC(dc_9bit, "carry DC in bit 8 of 9-bit words instead of the DC line");
+static unsigned speed_hz = 2000000;
+module_param(speed_hz, uint, S_IRUGO);
+MODULE_PARM_DESC(speed_hz, "spi-max-frequency of the emulated panel");
+static unsigned refresh_ms = 300;
+module_param(refresh_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(refresh_ms, "BUSY time after MASTER_ACTIVATION");
+static unsigned reset_busy_ms = 2;
+module_param(reset_busy_ms, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(reset_busy_ms, "BUSY time after RESET is released");
+static bool clock_model = true;
+module_param(clock_model, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(clock_model, "stall every transfer for its time on the wire at the transfer clock");
+
+struct epaper_emu_stats {
+    u64                     transfers;
+    u64                     bytes;
+    u64                     cmds;
+    u64                     data;
+    u64                     wire_ns;    /* modelled clock time */
+    u64                     busy_ns;    /* modelled BUSY time */
+    u64                     refreshes;
+    u64                     resets;
+    u64                     first_ns;
+    u64                     last_ns;
+};
+
+struct epaper_emu_xfer {
+    u64                     ns;
+    u32                     len;        /* words on the wire */
+    u8                      dc;         /* of the first word */
+    u8                      rx;
+    u8                      head[EMU_LOG_BYTES];
+};
+
+struct epaper_emu {
+    struct device           *root;
+    struct gpio_chip        gc;
+    struct spi_master       *master;
+    struct spi_device       *spi;
+    struct gpiod_lookup_table *lookup;
+    spinlock_t              lock;
+
+    int                     dc;
+    int                     reset;
+    u64                     busy_until;
+
+    /* controller model, driven from the SPI pump thread */
+    u8                      cmd;
+    unsigned                nargs;
+    u8                      args[4];
+    u8                      *ram;
+    u32                     line_length;
+    u32                     xs, xe, ys, ye;
+    u32                     x, y;
+    u8                      entry;
+    bool                    sleeping;
+    bool                    read_dummy;
+
+    struct epaper_emu_stats stats;
+    /* ring of the last EMU_LOG_SIZE transfers, log_count ever logged */
+    struct epaper_emu_xfer  log[EMU_LOG_SIZE];
+    u64                     log_count;
+    struct dentry           *debugfs;
+    struct debugfs_blob_wrapper ram_blob;
+};
+
+static struct epaper_emu *emu;
+
+/*-------------------------------------------------------------------------*/
+static bool epaper_emu_busy(struct epaper_emu *e)
+{
+    return ktime_get_ns() < e->busy_until;
+}
+
+static void epaper_emu_hold_busy(struct epaper_emu *e, unsigned ms)
+{
+    u64 ns = (u64)ms * NSEC_PER_MSEC;
+
+    e->busy_until = ktime_get_ns() + ns;
+    e->stats.busy_ns += ns;
+}
+
+static void epaper_emu_hw_reset(struct epaper_emu *e)
+{
+    e->cmd = 0;
+    e->nargs = 0;
+    e->xs = e->ys = e->x = e->y = 0;
+    e->xe = e->line_length - 1;
+    e->ye = height - 1;
+    e->entry = 0x03;
+    e->sleeping = false;
+    e->stats.resets++;
+    epaper_emu_hold_busy(e, reset_busy_ms);
+}
+
+static int epaper_emu_gpio_get(struct gpio_chip *gc, unsigned offset)
+{
+    struct epaper_emu *e = gpiochip_get_data(gc);
+
+    switch (offset) {
+        case EMU_GPIO_BUSY:
+            return epaper_emu_busy(e);
+        case EMU_GPIO_DC:
+            return e->dc;
+        default:
+            return e->reset;
+    }
+}
+
+static void epaper_emu_gpio_set(struct gpio_chip *gc, unsigned offset, int value)
+{
+    struct epaper_emu *e = gpiochip_get_data(gc);
+    unsigned long flags;
+
+    spin_lock_irqsave(&e->lock, flags);
+    if (offset == EMU_GPIO_DC) {
+        e->dc = !!value;
+    } else if (offset == EMU_GPIO_RESET) {
+        /* the controller comes out of reset on the rising edge */
+        if (!e->reset && value)
+            epaper_emu_hw_reset(e);
+        e->reset = !!value;
+    }
+    spin_unlock_irqrestore(&e->lock, flags);
+}
+
+static int epaper_emu_gpio_get_direction(struct gpio_chip *gc, unsigned offset)
+{
+    return offset == EMU_GPIO_BUSY ? 1 : 0;
+}
+
+static int epaper_emu_gpio_input(struct gpio_chip *gc, unsigned offset)
+{
+    return offset == EMU_GPIO_BUSY ? 0 : -EINVAL;
+}
+
+static int
+epaper_emu_gpio_output(struct gpio_chip *gc, unsigned offset, int value)
+{
+    if (offset == EMU_GPIO_BUSY)
+        return -EINVAL;
+    epaper_emu_gpio_set(gc, offset, value);
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*/
+/* step the address counter along the data entry mode */
+static void epaper_emu_advance(struct epaper_emu *e)
+{
+    bool xinc = e->entry & 0x01, yinc = e->entry & 0x02;
+    bool ydir = e->entry & 0x04;
+    u32 xlo = min(e->xs, e->xe), xhi = max(e->xs, e->xe);
+    u32 ylo = min(e->ys, e->ye), yhi = max(e->ys, e->ye);
+    bool wrap;
+
+    if (!ydir) {
+        wrap = xinc ? e->x >= xhi : e->x <= xlo;
+        e->x = wrap ? (xinc ? xlo : xhi) : (xinc ? e->x + 1 : e->x - 1);
+        if (!wrap)
+            return;
+        e->y = yinc ? (e->y >= yhi ? ylo : e->y + 1) :
+                      (e->y <= ylo ? yhi : e->y - 1);
+    } else {
+        wrap = yinc ? e->y >= yhi : e->y <= ylo;
+        e->y = wrap ? (yinc ? ylo : yhi) : (yinc ? e->y + 1 : e->y - 1);
+        if (!wrap)
+            return;
+        e->x = xinc ? (e->x >= xhi ? xlo : e->x + 1) :
+                      (e->x <= xlo ? xhi : e->x - 1);
+    }
+}
+
+static u8 *epaper_emu_cell(struct epaper_emu *e)
+{
+    if (e->x >= e->line_length || e->y >= height)
+        return NULL;
+    return e->ram + e->y * e->line_length + e->x;
+}
+
+static void epaper_emu_cmd(struct epaper_emu *e, u8 cmd)
+{
+    e->stats.cmds++;
+    e->cmd = cmd;
+    e->nargs = 0;
+    switch (cmd) {
+        case MASTER_ACTIVATION:
+            e->stats.refreshes++;
+            epaper_emu_hold_busy(e, refresh_ms);
+            break;
+        case READ_RAM:
+            e->read_dummy = true;
+            break;
+    }
+}
+
+static void epaper_emu_data(struct epaper_emu *e, u8 byte)
+{
+    u8 *cell;
+
+    e->stats.data++;
+    if (e->nargs < ARRAY_SIZE(e->args))
+        e->args[e->nargs] = byte;
+    e->nargs++;
+
+    switch (e->cmd) {
+        case WRITE_RAM:
+            cell = epaper_emu_cell(e);
+            if (cell)
+                *cell = byte;
+            epaper_emu_advance(e);
+            break;
+        case DATA_ENTRY_MODE_SETTING:
+            e->entry = byte & 0x07;
+            break;
+        case DEEP_SLEEP_MODE:
+            e->sleeping = byte & 0x01;
+            break;
+        case SET_RAM_X_ADDRESS_START_END_POSITION:
+            if (e->nargs == 2) {
+                e->xs = e->args[0];
+                e->xe = e->args[1];
+            }
+            break;
+        case SET_RAM_Y_ADDRESS_START_END_POSITION:
+            if (e->nargs == 4) {
+                e->ys = e->args[0] | (e->args[1] << 8);
+                e->ye = e->args[2] | (e->args[3] << 8);
+            }
+            break;
+        case SET_RAM_X_ADDRESS_COUNTER:
+            e->x = byte;
+            break;
+        case SET_RAM_Y_ADDRESS_COUNTER:
+            if (e->nargs == 2)
+                e->y = e->args[0] | (e->args[1] << 8);
+            break;
+    }
+}
+
+static u8 epaper_emu_read(struct epaper_emu *e)
+{
+    u8 *cell;
+
+    if (e->cmd != READ_RAM)
+        return 0xFF;
+    if (e->read_dummy) {
+        e->read_dummy = false;
+        return 0x00;
+    }
+    cell = epaper_emu_cell(e);
+    epaper_emu_advance(e);
+    return cell ? *cell : 0xFF;
+}
+
+static void epaper_emu_log(struct epaper_emu *e, const struct spi_transfer *t,
+        unsigned bits, unsigned words, u64 now)
+{
+    struct epaper_emu_xfer *x = &e->log[e->log_count++ % EMU_LOG_SIZE];
+    unsigned i, n = min_t(unsigned, words, EMU_LOG_BYTES);
+    u16 w;
+
+    x->ns = now;
+    x->len = words;
+    x->rx = !t->tx_buf;
+    x->dc = e->dc;
+    memset(x->head, 0, sizeof(x->head));
+    for (i = 0; t->tx_buf && i < n; i++) {
+        w = bits > 8 ? ((const u16 *)t->tx_buf)[i] : ((const u8 *)t->tx_buf)[i];
+        if (bits > 8 && !i)
+            x->dc = (w >> 8) & 1;
+        x->head[i] = w & 0xFF;
+    }
+}
+
+static int epaper_emu_transfer_one(struct spi_master *master,
+        struct spi_device *spi, struct spi_transfer *t)
+{
+    struct epaper_emu *e = spi_master_get_devdata(master);
+    unsigned bits = t->bits_per_word ? t->bits_per_word : spi->bits_per_word;
+    unsigned words = bits > 8 ? t->len / 2 : t->len;
+    u32 hz = t->speed_hz ? t->speed_hz : spi->max_speed_hz;
+    const u8 *tx = t->tx_buf;
+    u8 *rx = t->rx_buf;
+    unsigned long flags;
+    unsigned i;
+    u64 now, ns;
+    int dc;
+    u16 w;
+
+    spin_lock_irqsave(&e->lock, flags);
+    now = ktime_get_ns();
+    if (!e->stats.transfers)
+        e->stats.first_ns = now;
+    e->stats.transfers++;
+    e->stats.bytes += words;
+    epaper_emu_log(e, t, bits, words, now);
+    for (i = 0; i < words; i++) {
+        /* in 9-bit mode DC travels in bit 8 of each word */
+        if (bits > 8) {
+            w = tx ? ((const u16 *)tx)[i] : 0;
+            dc = (w >> 8) & 1;
+        } else {
+            w = tx ? tx[i] : 0;
+            dc = e->dc;
+        }
+        if (rx && bits == 8) {
+            rx[i] = e->sleeping || !e->reset ? 0xFF : epaper_emu_read(e);
+            continue;
+        }
+        if (!tx || e->sleeping || !e->reset)
+            continue;
+        if (dc)
+            epaper_emu_data(e, w & 0xFF);
+        else
+            epaper_emu_cmd(e, w & 0xFF);
+    }
+    ns = hz ? div_u64((u64)words * bits * NSEC_PER_SEC, hz) : 0;
+    e->stats.wire_ns += ns;
+    e->stats.last_ns = now + ns;
+    spin_unlock_irqrestore(&e->lock, flags);
+
+    if (clock_model && ns) {
+        if (ns < 10 * NSEC_PER_USEC)
+            ndelay(ns);
+        else
+            usleep_range(div_u64(ns, NSEC_PER_USEC),
+                         div_u64(ns, NSEC_PER_USEC) + 10);
+    }
+    return 0;
+}
+
+/*-------------------------------------------------------------------------*/
+/* payload bytes per second between the first and the last transfer */
+static int epaper_emu_throughput_get(void *data, u64 *val)
+{
+    struct epaper_emu *e = data;
+    u64 span = e->stats.last_ns - e->stats.first_ns;
+
+    *val = span ? div64_u64(e->stats.bytes * NSEC_PER_SEC, span) : 0;
+    return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(epaper_emu_throughput_fops, epaper_emu_throughput_get,
+                        NULL, "%llu\n");
+
+static int epaper_emu_clear_set(void *data, u64 val)
+{
+    struct epaper_emu *e = data;
+    unsigned long flags;
+
+    spin_lock_irqsave(&e->lock, flags);
+    memset(&e->stats, 0, sizeof(e->stats));
+    e->log_count = 0;
+    spin_unlock_irqrestore(&e->lock, flags);
+    return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(epaper_emu_clear_fops, NULL, epaper_emu_clear_set,
+                        "%llu\n");
+
+/* one line per transfer, oldest first: time, DC or "rx", length, bytes */
+static int epaper_emu_log_show(struct seq_file *m, void *v)
+{
+    struct epaper_emu *e = m->private;
+    struct epaper_emu_xfer *log;
+    unsigned long flags;
+    u64 count, i;
+    unsigned n;
+
+    log = kmalloc(sizeof(e->log), GFP_KERNEL);
+    if (!log)
+        return -ENOMEM;
+    spin_lock_irqsave(&e->lock, flags);
+    memcpy(log, e->log, sizeof(e->log));
+    count = e->log_count;
+    spin_unlock_irqrestore(&e->lock, flags);
+
+    i = count > EMU_LOG_SIZE ? count - EMU_LOG_SIZE : 0;
+    for (; i < count; i++) {
+        struct epaper_emu_xfer *x = &log[i % EMU_LOG_SIZE];
+
+        n = min_t(unsigned, x->len, EMU_LOG_BYTES);
+        seq_printf(m, "%llu %s %u:", x->ns, x->rx ? "rx" : x->dc ? "data" : "cmd",
+                   x->len);
+        if (!x->rx && n)
+            seq_printf(m, " %*ph%s", n, x->head,
+                       x->len > EMU_LOG_BYTES ? " ..." : "");
+        seq_putc(m, '\n');
+    }
+    kfree(log);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(epaper_emu_log);
+
+static void epaper_emu_debugfs_init(struct epaper_emu *e)
+{
+    struct dentry *d = debugfs_create_dir("epaper_emu", NULL);
+
+    e->debugfs = d;
+    debugfs_create_u64("transfers", S_IRUGO, d, &e->stats.transfers);
+    debugfs_create_u64("bytes", S_IRUGO, d, &e->stats.bytes);
+    debugfs_create_u64("cmds", S_IRUGO, d, &e->stats.cmds);
+    debugfs_create_u64("data", S_IRUGO, d, &e->stats.data);
+    debugfs_create_u64("wire_ns", S_IRUGO, d, &e->stats.wire_ns);
+    debugfs_create_u64("busy_ns", S_IRUGO, d, &e->stats.busy_ns);
+    debugfs_create_u64("refreshes", S_IRUGO, d, &e->stats.refreshes);
+    debugfs_create_u64("resets", S_IRUGO, d, &e->stats.resets);
+    debugfs_create_file("throughput", S_IRUGO, d, e,
+                        &epaper_emu_throughput_fops);
+    debugfs_create_file("clear", S_IWUSR, d, e, &epaper_emu_clear_fops);
+    debugfs_create_file("log", S_IRUGO, d, e, &epaper_emu_log_fops);
+    e->ram_blob.data = e->ram;
+    e->ram_blob.size = e->line_length * height;
+    debugfs_create_blob("ram", S_IRUGO, d, &e->ram_blob);
+}
+
+/*-------------------------------------------------------------------------*/
+static int __init epaper_emu_init(void)
+{
+    /* what the DT node would say, the driver reads it as device properties */
+    struct property_entry props[4] = {
+        PROPERTY_ENTRY_U32("width", width),
+        PROPERTY_ENTRY_U32("height", height),
+    };
+    struct spi_board_info info = {
+        .modalias       = "epaper_spi",
+        .max_speed_hz   = speed_hz,
+        .chip_select    = 0,
+        .mode           = SPI_MODE_0,
+        .properties     = props,
+    };
+    struct spi_master *master;
+    int status;
+
+    if (dc_9bit)
+        props[2] = (struct property_entry)PROPERTY_ENTRY_BOOL("dc-9bit");
+
+    emu = kzalloc(sizeof(*emu), GFP_KERNEL);
+    if (!emu)
+        return -ENOMEM;
+    spin_lock_init(&emu->lock);
+    emu->line_length = DIV_ROUND_UP(width, 8);
+    emu->ram = kmalloc(emu->line_length * height, GFP_KERNEL);
+    if (!emu->ram) {
+        status = -ENOMEM;
+        goto err_free;
+    }
+    memset(emu->ram, 0xFF, emu->line_length * height);
+    emu->xe = emu->line_length - 1;
+    emu->ye = height - 1;
+    emu->entry = 0x03;
+
+    emu->root = root_device_register("epaper_emu");
+    if (IS_ERR(emu->root)) {
+        status = PTR_ERR(emu->root);
+        goto err_free;
+    }
+
+    emu->gc.label = EMU_LABEL;
+    emu->gc.parent = emu->root;
+    emu->gc.owner = THIS_MODULE;
+    emu->gc.base = -1;
+    emu->gc.ngpio = EMU_NGPIO;
+    emu->gc.get = epaper_emu_gpio_get;
+    emu->gc.set = epaper_emu_gpio_set;
+    emu->gc.get_direction = epaper_emu_gpio_get_direction;
+    emu->gc.direction_input = epaper_emu_gpio_input;
+    emu->gc.direction_output = epaper_emu_gpio_output;
+    status = gpiochip_add_data(&emu->gc, emu);
+    if (status)
+        goto err_root;
+
+    master = spi_alloc_master(emu->root, 0);
+    if (!master) {
+        status = -ENOMEM;
+        goto err_gpio;
+    }
+    master->bus_num = -1;
+    master->num_chipselect = 1;
+    master->mode_bits = SPI_CPOL | SPI_CPHA | SPI_3WIRE;
+    master->bits_per_word_mask = SPI_BPW_MASK(8) | SPI_BPW_MASK(9);
+    master->min_speed_hz = 100000;
+    master->max_speed_hz = 50000000;
+    master->transfer_one = epaper_emu_transfer_one;
+    spi_master_set_devdata(master, emu);
+    status = spi_register_master(master);
+    if (status) {
+        spi_master_put(master);
+        goto err_gpio;
+    }
+    emu->master = master;
+
+    /* what a DT node with busy-, dc- and reset-gpios would provide */
+    emu->lookup = kzalloc(struct_size(emu->lookup, table, EMU_NGPIO + 1),
+                          GFP_KERNEL);
+    if (!emu->lookup) {
+        status = -ENOMEM;
+        goto err_master;
+    }
+    emu->lookup->dev_id = kasprintf(GFP_KERNEL, "spi%d.0", master->bus_num);
+    if (!emu->lookup->dev_id) {
+        status = -ENOMEM;
+        goto err_lookup;
+    }
+    emu->lookup->table[0] = (struct gpiod_lookup)
+        GPIO_LOOKUP(EMU_LABEL, EMU_GPIO_BUSY, "busy", GPIO_ACTIVE_HIGH);
+    emu->lookup->table[1] = (struct gpiod_lookup)
+        GPIO_LOOKUP(EMU_LABEL, EMU_GPIO_DC, "dc", GPIO_ACTIVE_HIGH);
+    emu->lookup->table[2] = (struct gpiod_lookup)
+        GPIO_LOOKUP(EMU_LABEL, EMU_GPIO_RESET, "reset", GPIO_ACTIVE_HIGH);
+    gpiod_add_lookup_table(emu->lookup);
+
+    epaper_emu_debugfs_init(emu);
+
+    emu->spi = spi_new_device(master, &info);
+    if (!emu->spi) {
+        status = -ENODEV;
+        goto err_debugfs;
+    }
+    dev_info(emu->root, "emulated %ux%u panel on %s\n", width, height,
+             dev_name(&emu->spi->dev));
+    return 0;
+
+err_debugfs:
+    debugfs_remove_recursive(emu->debugfs);
+    gpiod_remove_lookup_table(emu->lookup);
+    kfree(emu->lookup->dev_id);
+err_lookup:
+    kfree(emu->lookup);
+err_master:
+    spi_unregister_master(emu->master);
+err_gpio:
+    gpiochip_remove(&emu->gc);
+err_root:
+    root_device_unregister(emu->root);
+err_free:
+    kfree(emu->ram);
+    kfree(emu);
+    return status;
+}
+module_init(epaper_emu_init);
+
+static void __exit epaper_emu_exit(void)
+{
+    u64 tput;
+
+    epaper_emu_throughput_get(emu, &tput);
+    dev_info(emu->root, "%llu bytes in %llu transfers, %llu B/s, %llu refreshes\n",
+             emu->stats.bytes, emu->stats.transfers, tput, emu->stats.refreshes);
+
+    spi_unregister_device(emu->spi);
+    debugfs_remove_recursive(emu->debugfs);
+    gpiod_remove_lookup_table(emu->lookup);
+    kfree(emu->lookup->dev_id);
+    kfree(emu->lookup);
+    spi_unregister_master(emu->master);
+    gpiochip_remove(&emu->gc);
+    root_device_unregister(emu->root);
+    kfree(emu->ram);
+    kfree(emu);
+}
+module_exit(epaper_emu_exit);
+
+MODULE_DESCRIPTION("Emulated SPI controller and panel for epaper_spi");
+MODULE_LICENSE("GPL v2");
@@ -13,34 +13,241 @@
 #include <linux/compat.h>
 #include <linux/of_device.h>
 #include <linux/of.h>
+#include <linux/property.h>
 #include <linux/gpio/consumer.h>
 #include <linux/gpio.h>
 #include <linux/delay.h>
+#include <linux/mm.h>
+#include <linux/interrupt.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/eventfd.h>
+#include <linux/uio.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/fb.h>
+#include <linux/vmalloc.h>
+#include <linux/bitrev.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/pm_runtime.h>
+#include <linux/workqueue.h>
+#include <linux/crc32.h>
 
 #include "epaper_cmds.h"
 
+#define CREATE_TRACE_POINTS
+#include "epaper_trace.h"
+
 #define EPAPER_SPI_MAJOR 225
-#define N_SPI_MINORS 2
+#define N_SPI_MINORS 8
+
+#define EPAPER_BUSY_TIMEOUT_MS 10000
+/* longest RESET phase, datasheets ask for a few ms each */
+#define EPAPER_RESET_MAX_MS 1000
+#define EPAPER_CMD_BUFSIZ 32
+#define EPAPER_ASYNC_SLOTS 4
+#define EPAPER_ZC_PAGES 16
+/* clean rows tolerated inside one dirty band before it is split */
+#define EPAPER_DIFF_GAP 4
+#define EPAPER_SELFTEST_ROWS 8
+#define EPAPER_FRAME_SLOTS 2
+/* pending fences per device, queued or merged into a queued job */
+#define EPAPER_JOB_MAX 64
+#define EPAPER_FLUSH_MASK \
+    (EPAPER_FLUSH_REFRESH | EPAPER_FLUSH_FORCE | EPAPER_FLUSH_VERIFY)
+/* internal job type behind EPAPER_SUBMIT_FRAME */
+#define EPAPER_JOB_FRAME 0x100
+
+#if IS_ENABLED(CONFIG_FB_DEFERRED_IO) && IS_ENABLED(CONFIG_FB_SYS_FOPS) && \
+    IS_ENABLED(CONFIG_FB_SYS_FILLRECT) && IS_ENABLED(CONFIG_FB_SYS_COPYAREA) && \
+    IS_ENABLED(CONFIG_FB_SYS_IMAGEBLIT)
+#define EPAPER_FBDEV 1
+#endif
+
+#define EPAPER_DEFAULT_WIDTH 200
+#define EPAPER_DEFAULT_HEIGHT 200
+#define EPAPER_DEFAULT_RESET_MS 200
+
+/* controller commands used by the in-kernel upload paths */
+#define DRIVER_OUTPUT_CONTROL                       0x01
+#define BOOSTER_SOFT_START_CONTROL                  0x0C
+#define DEEP_SLEEP_MODE                             0x10
+#define DATA_ENTRY_MODE_SETTING                     0x11
+#define DISPLAY_UPDATE_CONTROL_2                    0x22
+#define MASTER_ACTIVATION                           0x20
+#define WRITE_RAM                                   0x24
+#define READ_RAM                                    0x27
+#define WRITE_VCOM_REGISTER                         0x2C
+#define WRITE_LUT_REGISTER                          0x32
+#define SET_DUMMY_LINE_PERIOD                       0x3A
+#define SET_RAM_X_ADDRESS_START_END_POSITION        0x44
+#define SET_RAM_Y_ADDRESS_START_END_POSITION        0x45
+#define SET_RAM_X_ADDRESS_COUNTER                   0x4E
+#define SET_RAM_Y_ADDRESS_COUNTER                   0x4F
+#define TERMINATE_FRAME_READ_WRITE                  0xFF
 
 static struct class *epaper_class;
+static struct dentry *epaper_debugfs_root;
 static unsigned bufsiz = 4096;
 module_param(bufsiz, uint, S_IRUGO);
+static unsigned zerocopy_min = PAGE_SIZE;
+module_param(zerocopy_min, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(zerocopy_min, "pin user pages for writes of at least this many bytes (0 = always copy)");
+static unsigned autosuspend_ms = 30000;
+module_param(autosuspend_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(autosuspend_ms, "idle time after the last close before a panel with an EPAPER_SET_INIT script is put into deep sleep (power/autosuspend_delay_ms per device)");
+#ifdef EPAPER_FBDEV
+static bool fbdev;
+module_param(fbdev, bool, S_IRUGO);
+MODULE_PARM_DESC(fbdev, "register a deferred-io framebuffer for each panel, it needs an init-sequence property or EPAPER_SET_INIT");
+static unsigned fbdev_delay_ms = 250;
+module_param(fbdev_delay_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(fbdev_delay_ms, "framebuffer damage collection delay");
+#endif
+
+struct epaper_drv_data;
+struct epaper_job;
+
+struct epaper_async_slot {
+    struct spi_message      msg;
+    struct spi_transfer     xfer;
+    u8                      *buf;
+    u64                     seq;
+    int                     dc;
+    struct epaper_drv_data  *epd;
+    struct device           *dev;   /* holds a runtime PM reference */
+};
+
+enum {
+    EPAPER_FRAME_FREE,
+    EPAPER_FRAME_FILLING,   /* being copied from userspace */
+    EPAPER_FRAME_QUEUED,
+    EPAPER_FRAME_BUSY,      /* owned by the job worker */
+};
+
+struct epaper_frame_slot {
+    u8                      *buf;
+    u64                     seq;
+    u32                     flags;
+    int                     state;
+};
+
+/*
+ * Exported through debugfs. Counters are bumped without extra locking,
+ * they are for diagnostics only.
+ */
+struct epaper_stats {
+    u64                     tx_bytes;
+    u64                     messages;
+    u64                     sync_ns;
+    u64                     sync_max_ns;
+    u64                     busy_ns;
+    u64                     resets;
+    u64                     copy_bytes;
+    u64                     copy_ns;
+    u64                     zc_bytes;
+    u64                     zc_ns;
+    u64                     flush_bytes;
+    u64                     ram_bytes;
+    u64                     jobs_coalesced;
+    u64                     verify_fail;
+};
 
 struct epaper_drv_data {
+    /* held by the bound device, every open file and every mapping of fb */
+    struct kref             kref;
     dev_t                   devt;
     struct spi_device       *spi;
     u8                      *tx_buffer;
     u8                      *rx_buffer;
+    u8                      *cmd_buf;
+    u8                      *fb;
+    u8                      *ram;       /* last frame sent to controller RAM */
+    u8                      *init_script;   /* from EPAPER_SET_INIT, or NULL */
+    size_t                  init_len;
+    bool                    asleep;         /* deep sleep until the next reset */
+    struct epaper_reset_timing reset_timing;
+    bool                    ram_valid;
+    /* last raw command byte, current while no other message went out */
+    int                     raw_cmd;
+    u64                     raw_seq;
+    u64                     sync_seq;       /* messages sent by epaper_sync() */
+    size_t                  fb_size;
+    u32                     width;
+    u32                     height;
+    u32                     line_length;
     spinlock_t              spi_lock;
     struct mutex            buf_lock;
     unsigned                users;
     u32                     speed_hz;
     int                     reset_gpio;
     int                     busy_gpio;
-    int                     dc_gpio;
+    int                     dc_gpio;        /* -1 when DC travels in bit 8 */
+    bool                    dc_9bit;
+    int                     dc_cur;
+    u16                     *tx9;           /* 9-bit words, under buf_lock */
+    size_t                  tx9_words;
+    int                     busy_irq;
+    wait_queue_head_t       idle_wq;
+
+    /* spi_async ring, filled under buf_lock and drained by completions */
+    struct epaper_async_slot    async[EPAPER_ASYNC_SLOTS];
+    struct work_struct      async_work;     /* starts the next slot */
+    spinlock_t              async_lock;
+    unsigned                async_head;
+    unsigned                async_tail;
+    unsigned                async_count;
+    bool                    async_busy;
+    u64                     async_seq;
+    u64                     async_done;
+    u64                     async_reported;
+    int                     async_status;
+    wait_queue_head_t       async_wq;
+    struct eventfd_ctx      *async_eventfd;
+
+    /* job queue and double-buffered frames, all under job_lock */
+    struct workqueue_struct *wq;
+    struct work_struct      job_work;
+    struct list_head        jobs;           /* by priority, then fence */
+    struct epaper_job       *job_running;
+    struct epaper_job       *job_failed;    /* most recent to fail, kept for its fences */
+    unsigned int            job_count;      /* pending, see EPAPER_JOB_MAX */
+    struct epaper_frame_slot    frames[EPAPER_FRAME_SLOTS];
+    spinlock_t              job_lock;
+    u64                     job_seq;        /* last fence handed out */
+    int                     job_error;
+    wait_queue_head_t       job_wq;
+
+    /* zero-copy write path, used under buf_lock */
+    struct page             *zc_pages[EPAPER_ZC_PAGES];
+    struct spi_transfer     zc_xfers[EPAPER_ZC_PAGES];
+
+    struct epaper_stats     stats;
+    struct dentry           *debugfs;
+
+#ifdef EPAPER_FBDEV
+    struct fb_info          *fb_info;
+    struct fb_ops           fb_ops;
+    struct fb_deferred_io   fb_defio;
+    u8                      *fb_screen;
+    spinlock_t              fb_damage_lock;
+    u32                     fb_damage_y0;
+    u32                     fb_damage_y1;
+#endif
 };
 
-static struct epaper_drv_data *epaper_drv_data_p;
+/* per open file */
+struct epaper_file {
+    struct epaper_drv_data  *epd;
+    int                     dc_level;   /* for EPAPER_WRITE_RAW writes */
+    u32                     write_mode;
+};
+
+/* minor -> struct epaper_drv_data, users counts are also under this lock */
+static DEFINE_IDR(epaper_minors);
+static DEFINE_MUTEX(device_list_lock);
 
 static const struct of_device_id epaper_dt_ids[] = {                      
     { .compatible = "epaper" },
@@ -48,81 +255,1762 @@ static const struct of_device_id epaper_dt_ids[] = {
 };
 MODULE_DEVICE_TABLE(of, epaper_dt_ids);
 
+static void epaper_job_free(struct epaper_job *job);
+
+static void epaper_free(struct epaper_drv_data *epd)
+{
+    int i;
+
+    cancel_work_sync(&epd->async_work);
+    for (i = 0; i < EPAPER_ASYNC_SLOTS; i++)
+        kfree(epd->async[i].buf);
+    if (epd->wq)
+        destroy_workqueue(epd->wq);
+    for (i = 0; i < EPAPER_FRAME_SLOTS; i++)
+        kfree(epd->frames[i].buf);
+    if (epd->job_failed)
+        epaper_job_free(epd->job_failed);
+    if (epd->async_eventfd)
+        eventfd_ctx_put(epd->async_eventfd);
+    if (epd->fb)
+        free_pages_exact(epd->fb, epd->fb_size);
+    /* open files may still drive the pins, so they live as long as epd */
+    if (epd->reset_gpio >= 0)
+        gpiod_put(gpio_to_desc(epd->reset_gpio));
+    if (epd->dc_gpio >= 0)
+        gpiod_put(gpio_to_desc(epd->dc_gpio));
+    if (epd->busy_gpio >= 0)
+        gpiod_put(gpio_to_desc(epd->busy_gpio));
+    kfree(epd->ram);
+    kfree(epd->init_script);
+    kfree(epd->cmd_buf);
+    kfree(epd->tx9);
+    kfree(epd);
+}
+
+static void epaper_kref_release(struct kref *kref)
+{
+    epaper_free(container_of(kref, struct epaper_drv_data, kref));
+}
+
 /*---------------------------------------------------------------------------*/
+/*
+ * DC goes through here. In 9-bit mode there is no GPIO to toggle, the
+ * level is remembered and packed into every word of the next message.
+ */
+static void epaper_set_dc(struct epaper_drv_data *epd, int level)
+{
+    epd->dc_cur = level;
+    if (!epd->dc_9bit)
+        gpio_set_value_cansleep(epd->dc_gpio, level);
+}
+
+/* a 9-bit word carries DC in bit 8 above the payload byte */
+static void epaper_pack9(u16 *dst, const u8 *src, size_t len, int dc)
+{
+    u16 hi = dc ? 0x100 : 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        dst[i] = hi | src[i];
+}
+
+/*
+ * Repoint the tx transfers of a message at 9-bit words in tx9. Reading
+ * back is not supported in this mode.
+ */
+static int epaper_pack_message(struct epaper_drv_data *epd,
+        struct spi_message *message)
+{
+    struct spi_transfer *t;
+    size_t words = 0;
+    u16 *p;
+
+    list_for_each_entry(t, &message->transfers, transfer_list) {
+        if (t->rx_buf)
+            return -EOPNOTSUPP;
+        words += t->len;
+    }
+    if (words > epd->tx9_words) {
+        kfree(epd->tx9);
+        epd->tx9 = kmalloc_array(words, sizeof(u16), GFP_KERNEL);
+        epd->tx9_words = epd->tx9 ? words : 0;
+        if (!epd->tx9)
+            return -ENOMEM;
+    }
+
+    p = epd->tx9;
+    list_for_each_entry(t, &message->transfers, transfer_list) {
+        epaper_pack9(p, t->tx_buf, t->len, epd->dc_cur);
+        t->tx_buf = p;
+        p += t->len;
+        t->len *= sizeof(u16);
+        t->bits_per_word = 9;
+    }
+    return 0;
+}
+
 static ssize_t
 epaper_sync(struct epaper_drv_data *epd, struct spi_message *message)
 {
     DECLARE_COMPLETION_ONSTACK(done);
     int status;
     struct spi_device *spi;
+    struct spi_transfer *t;
+    unsigned len = 0;
+    u64 t0, ns;
     
     spin_lock_irq(&epd->spi_lock);
     spi = epd->spi;
     spin_unlock_irq(&epd->spi_lock);
 
+    if (trace_epaper_sync_start_enabled()) {
+        list_for_each_entry(t, &message->transfers, transfer_list)
+            len += t->len;
+        trace_epaper_sync_start(MINOR(epd->devt), len);
+    }
+
+    epd->sync_seq++;
+    t0 = ktime_get_ns();
     if(spi == NULL)
         status = -ESHUTDOWN;
     else
+        status = epd->dc_9bit ? epaper_pack_message(epd, message) : 0;
+    if (status == 0)
         status = spi_sync(spi, message);
+    ns = ktime_get_ns() - t0;
+    trace_epaper_sync_done(MINOR(epd->devt), status, ns);
 
-    if (status == 0)
+    if (status == 0) {
         status = message->actual_length;
+        /* callers count payload bytes, not 9-bit words */
+        if (epd->dc_9bit)
+            status /= sizeof(u16);
+        epd->stats.tx_bytes += status;
+        epd->stats.messages++;
+        epd->stats.sync_ns += ns;
+        if (ns > epd->stats.sync_max_ns)
+            epd->stats.sync_max_ns = ns;
+    }
+
+    return status;
+}
+
+static inline ssize_t
+epaper_sync_write(struct epaper_drv_data *epd, size_t len)
+{
+    struct spi_transfer t = {
+        .tx_buf     = epd->tx_buffer,
+        .len        = len,
+        .speed_hz   = epd->speed_hz,
+    };
+    struct spi_message m;
+
+    spi_message_init(&m);
+    spi_message_add_tail(&t, &m);
+    return epaper_sync(epd, &m);
+}
+
+static inline ssize_t
+epaper_sync_read(struct epaper_drv_data *epd, size_t len)
+{
+    struct spi_transfer t = {
+        .rx_buf     = epd->rx_buffer,
+        .len        = len,
+        .speed_hz   = epd->speed_hz,
+    };
+    struct spi_message m;
+
+    spi_message_init(&m);
+    spi_message_add_tail(&t, &m);
+    return epaper_sync(epd, &m);
+}
+
+static void epaper_async_complete(void *context)
+{
+    struct epaper_async_slot *slot = context;
+    struct epaper_drv_data *epd = slot->epd;
+    unsigned long flags;
+    bool more;
+
+    /*
+     * Everything is signalled under async_lock: once a drain sees the
+     * ring empty, epd may go away, so it is not touched after unlock.
+     * This runs in atomic context, so the next slot is started from
+     * async_work, where DC may sleep.
+     */
+    spin_lock_irqsave(&epd->async_lock, flags);
+    if (slot->msg.status && !epd->async_status)
+        epd->async_status = slot->msg.status;
+    epd->async_done = slot->seq;
+    if (!slot->msg.status) {
+        epd->stats.tx_bytes += epd->dc_9bit ? slot->msg.actual_length / 2 :
+                                              slot->msg.actual_length;
+        epd->stats.messages++;
+    }
+    epd->async_tail = (epd->async_tail + 1) % EPAPER_ASYNC_SLOTS;
+    epd->async_count--;
+    epd->async_busy = false;
+    pm_runtime_mark_last_busy(slot->dev);
+    pm_runtime_put_autosuspend(slot->dev);
+    more = epd->async_count != 0;
+    if (epd->async_eventfd)
+        eventfd_signal(epd->async_eventfd, 1);
+    if (more)
+        schedule_work(&epd->async_work);
+    wake_up(&epd->async_wq);
+    spin_unlock_irqrestore(&epd->async_lock, flags);
+}
+
+/*
+ * Start the oldest queued slot unless a message is already on the bus.
+ * Only one async message is in flight at a time so that DC can be
+ * switched between them.
+ */
+static void epaper_async_kick(struct epaper_drv_data *epd)
+{
+    struct epaper_async_slot *slot = NULL;
+    struct spi_device *spi;
+    unsigned long flags;
+    int status;
+
+    spin_lock_irqsave(&epd->async_lock, flags);
+    if (!epd->async_busy && epd->async_count) {
+        slot = &epd->async[epd->async_tail];
+        epd->async_busy = true;
+    }
+    spin_unlock_irqrestore(&epd->async_lock, flags);
+    if (!slot)
+        return;
+
+    spin_lock_irqsave(&epd->spi_lock, flags);
+    spi = epd->spi;
+    spin_unlock_irqrestore(&epd->spi_lock, flags);
+
+    epaper_set_dc(epd, slot->dc);
+    status = spi ? spi_async(spi, &slot->msg) : -ESHUTDOWN;
+    /* a failed start completes here and reschedules async_work */
+    if (status) {
+        slot->msg.status = status;
+        epaper_async_complete(slot);
+    }
+}
+
+static void epaper_async_work(struct work_struct *work)
+{
+    epaper_async_kick(container_of(work, struct epaper_drv_data, async_work));
+}
+
+static bool epaper_async_test(struct epaper_drv_data *epd, unsigned max)
+{
+    unsigned long flags;
+    bool ret;
+
+    spin_lock_irqsave(&epd->async_lock, flags);
+    ret = epd->async_count <= max;
+    spin_unlock_irqrestore(&epd->async_lock, flags);
+
+    return ret;
+}
+
+/*
+ * Wait for all queued async messages before touching DC or the bus
+ * synchronously. The caller holds buf_lock, so nothing new is queued.
+ */
+static void epaper_async_drain(struct epaper_drv_data *epd)
+{
+    wait_event(epd->async_wq, epaper_async_test(epd, 0));
+}
+
+/*
+ * Wait for a free ring slot without holding buf_lock, then take it.
+ * Another submitter may have claimed the slot meanwhile, in which case
+ * the wait starts over. Returns with buf_lock held on success.
+ */
+static bool epaper_jobs_idle(struct epaper_drv_data *epd);
+
+/* async buffers are raw traffic as well, see epaper_raw_lock() */
+static int epaper_async_lock_slot(struct epaper_drv_data *epd, bool nonblock)
+{
+    int status;
+
+    for (;;) {
+        if (nonblock && (!epaper_async_test(epd, EPAPER_ASYNC_SLOTS - 1) ||
+                         !epaper_jobs_idle(epd)))
+            return -EAGAIN;
+        status = wait_event_interruptible(epd->async_wq,
+                    epaper_async_test(epd, EPAPER_ASYNC_SLOTS - 1));
+        if (!status)
+            status = wait_event_interruptible(epd->job_wq,
+                                              epaper_jobs_idle(epd));
+        if (status)
+            return status;
+        mutex_lock(&epd->buf_lock);
+        if (epaper_async_test(epd, EPAPER_ASYNC_SLOTS - 1) &&
+            epaper_jobs_idle(epd))
+            return 0;
+        mutex_unlock(&epd->buf_lock);
+    }
+}
+
+/* queue one buffer, the caller holds buf_lock and a free slot */
+static int
+epaper_async_submit(struct epaper_drv_data *epd, struct epaper_async *a)
+{
+    struct epaper_async_slot *slot;
+    unsigned long flags;
+    u8 *src;
+
+    /* the head slot is not visible to completions until async_count grows */
+    slot = &epd->async[epd->async_head];
+    /* 9-bit slots are twice bufsiz, the bytes land in the upper half */
+    src = epd->dc_9bit ? slot->buf + bufsiz : slot->buf;
+    if (copy_from_user(src, (void __user *)(uintptr_t)a->buf, a->len))
+        return -EFAULT;
+    slot->dc = !(a->flags & EPAPER_ASYNC_CMD);
+    memset(&slot->xfer, 0, sizeof(slot->xfer));
+    slot->xfer.tx_buf = slot->buf;
+    slot->xfer.len = a->len;
+    slot->xfer.speed_hz = epd->speed_hz;
+    if (epd->dc_9bit) {
+        /* packing forwards in place never overtakes the source */
+        epaper_pack9((u16 *)slot->buf, src, a->len, slot->dc);
+        slot->xfer.len *= sizeof(u16);
+        slot->xfer.bits_per_word = 9;
+    }
+    spi_message_init(&slot->msg);
+    spi_message_add_tail(&slot->xfer, &slot->msg);
+    slot->msg.complete = epaper_async_complete;
+    slot->msg.context = slot;
+    slot->dev = &epd->spi->dev;
+    /* the caller's runtime PM reference keeps the panel awake until here */
+    pm_runtime_get_noresume(slot->dev);
+
+    spin_lock_irqsave(&epd->async_lock, flags);
+    slot->seq = ++epd->async_seq;
+    epd->async_head = (epd->async_head + 1) % EPAPER_ASYNC_SLOTS;
+    epd->async_count++;
+    spin_unlock_irqrestore(&epd->async_lock, flags);
+
+    a->seq = slot->seq;
+    epaper_async_kick(epd);
+    return 0;
+}
+
+static void
+epaper_async_get_status(struct epaper_drv_data *epd,
+        struct epaper_async_status *st)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&epd->async_lock, flags);
+    st->submitted = epd->async_seq;
+    st->completed = epd->async_done;
+    st->error = epd->async_status;
+    st->pending = epd->async_count;
+    epd->async_status = 0;
+    epd->async_reported = epd->async_done;
+    spin_unlock_irqrestore(&epd->async_lock, flags);
+}
+
+static int epaper_async_set_eventfd(struct epaper_drv_data *epd, int fd)
+{
+    struct eventfd_ctx *ctx = NULL;
+
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+    /* drained by the caller, so no completion can see the old context */
+    if (epd->async_eventfd)
+        eventfd_ctx_put(epd->async_eventfd);
+    epd->async_eventfd = ctx;
+
+    return 0;
+}
+
+static irqreturn_t epaper_busy_irq(int irq, void *dev_id)
+{
+    struct epaper_drv_data *epd = dev_id;
+
+    wake_up_interruptible(&epd->idle_wq);
+    return IRQ_HANDLED;
+}
+
+static int __epaper_wait_idle(struct epaper_drv_data *epd, unsigned int timeout_ms)
+{
+    unsigned long deadline = jiffies + msecs_to_jiffies(timeout_ms);
+    long ret;
+
+    if (READ_ONCE(epd->busy_irq) >= 0) {
+        ret = wait_event_interruptible_timeout(epd->idle_wq,
+                    !gpio_get_value(epd->busy_gpio),
+                    msecs_to_jiffies(timeout_ms));
+        if (ret < 0)
+            return ret;
+        return ret ? 0 : -ETIMEDOUT;
+    }
+
+    /* no BUSY interrupt, fall back to polling */
+    while (gpio_get_value(epd->busy_gpio)) {
+        if (time_after(jiffies, deadline))
+            return -ETIMEDOUT;
+        usleep_range(1000, 2000);
+    }
+    return 0;
+}
+
+static int epaper_wait_idle(struct epaper_drv_data *epd, unsigned int timeout_ms)
+{
+    u64 t0 = ktime_get_ns(), ns;
+    int status;
+
+    status = __epaper_wait_idle(epd, timeout_ms);
+    ns = ktime_get_ns() - t0;
+    epd->stats.busy_ns += ns;
+    trace_epaper_wait_idle_done(MINOR(epd->devt), status, ns);
+
+    return status;
+}
+
+/* validate a packed segment stream, returns the number of segments */
+static ssize_t epaper_check_stream(const u8 *stream, size_t len)
+{
+    struct epaper_seg   seg;
+    size_t              pos, nsegs = 0;
+
+    for (pos = 0; pos < len; pos += sizeof(seg) + seg.len) {
+        if (len - pos < sizeof(seg))
+            return -EINVAL;
+        memcpy(&seg, stream + pos, sizeof(seg));
+        if (seg.op > EPAPER_SEG_DELAY ||
+            (seg.op == EPAPER_SEG_WAIT_IDLE && seg.len) ||
+            (seg.op == EPAPER_SEG_DELAY && seg.len != sizeof(u16)) ||
+            len - pos - sizeof(seg) < seg.len)
+            return -EINVAL;
+        nsegs++;
+    }
+    return nsegs;
+}
+
+/*
+ * Execute a packed segment stream (see struct epaper_seg). Segments are
+ * collected into one spi_message until the DC level changes or a
+ * wait-for-idle or delay marker is hit, then the message is sent in
+ * one go.
+ */
+static ssize_t
+epaper_run_stream(struct epaper_drv_data *epd, const u8 *stream, size_t len)
+{
+    struct spi_transfer *xfers;
+    struct spi_message  m;
+    struct epaper_seg   seg;
+    size_t              pos;
+    ssize_t             nsegs;
+    unsigned            n = 0, queued = 0;
+    int                 dc = -1;
+    ssize_t             status, sent = 0;
+    u16                 ms;
+
+    nsegs = epaper_check_stream(stream, len);
+    if (nsegs <= 0)
+        return nsegs;
+
+    xfers = kcalloc(nsegs, sizeof(*xfers), GFP_KERNEL);
+    if (!xfers)
+        return -ENOMEM;
+
+    spi_message_init(&m);
+    for (pos = 0; pos <= len; pos += sizeof(seg) + seg.len) {
+        if (pos < len)
+            memcpy(&seg, stream + pos, sizeof(seg));
+
+        /* flush the pending DC run */
+        if (queued && (pos == len || seg.op != dc)) {
+            status = epaper_sync(epd, &m);
+            if (status < 0)
+                goto out;
+            sent += status;
+            queued = 0;
+            spi_message_init(&m);
+        }
+        if (pos == len)
+            break;
+
+        if (seg.op == EPAPER_SEG_WAIT_IDLE) {
+            status = epaper_wait_idle(epd, EPAPER_BUSY_TIMEOUT_MS);
+            if (status < 0)
+                goto out;
+            continue;
+        }
+        if (seg.op == EPAPER_SEG_DELAY) {
+            memcpy(&ms, stream + pos + sizeof(seg), sizeof(ms));
+            msleep(ms);
+            continue;
+        }
+        if (!seg.len)
+            continue;
+        if (seg.op != dc) {
+            dc = seg.op;
+            epaper_set_dc(epd, dc == EPAPER_SEG_DATA);
+        }
+        xfers[n].tx_buf = stream + pos + sizeof(seg);
+        xfers[n].len = seg.len;
+        xfers[n].speed_hz = epd->speed_hz;
+        spi_message_add_tail(&xfers[n++], &m);
+        queued++;
+    }
+    status = sent;
+out:
+    kfree(xfers);
+    return status;
+}
+
+static void epaper_sleep_ms(u32 ms)
+{
+    if (ms < 20)
+        usleep_range(ms * 1000, ms * 1000 + 500);
+    else
+        msleep(ms);
+}
+
+/* both phases must be non-zero, high_ms bounds the BUSY wait */
+static bool epaper_reset_ms_valid(u32 ms)
+{
+    return ms && ms <= EPAPER_RESET_MAX_MS;
+}
+
+static int epaper_hw_reset(struct epaper_drv_data *epd)
+{
+    struct epaper_reset_timing *rt = &epd->reset_timing;
+
+    trace_epaper_reset(MINOR(epd->devt));
+    epd->stats.resets++;
+    epd->ram_valid = false;
+    epd->asleep = false;
+    gpio_set_value(epd->reset_gpio, 0);
+    epaper_sleep_ms(rt->low_ms);
+    gpio_set_value(epd->reset_gpio, 1);
+    if (!(rt->flags & EPAPER_RESET_WAIT_BUSY)) {
+        epaper_sleep_ms(rt->high_ms);
+        return 0;
+    }
+    /* give the controller time to raise BUSY before watching it fall */
+    usleep_range(1000, 1500);
+    return epaper_wait_idle(epd, rt->high_ms);
+}
+
+/*
+ * Reset the panel and replay the init script userspace handed over, if
+ * any. The driver has no init sequence of its own: LUT and geometry are
+ * whatever the client last set up.
+ */
+static int epaper_cold_start(struct epaper_drv_data *epd)
+{
+    ssize_t status;
+
+    status = epaper_hw_reset(epd);
+    if (status || !epd->init_script)
+        return status;
+    status = epaper_run_stream(epd, epd->init_script, epd->init_len);
+
+    return status < 0 ? status : 0;
+}
+
+/* install a userspace init script and run it */
+static int
+epaper_set_init(struct epaper_drv_data *epd, u8 *script, size_t len)
+{
+    ssize_t status;
+
+    status = epaper_check_stream(script, len);
+    if (status < 0) {
+        kfree(script);
+        return status;
+    }
+    kfree(epd->init_script);
+    epd->init_script = script;
+    epd->init_len = len;
+
+    return epaper_cold_start(epd);
+}
+
+/*
+ * Optional "init-sequence" property: records of a command byte, a data
+ * length byte and that many data bytes. It is turned into the init
+ * script, until EPAPER_SET_INIT replaces it, so a panel can be driven
+ * without a userspace client, e.g. through fbdev.
+ */
+static int epaper_init_from_fw(struct epaper_drv_data *epd, struct device *dev)
+{
+    struct epaper_seg seg = { 0 };
+    u8 *seq, *script, *p;
+    int n, pos, len;
+
+    n = device_property_read_u8_array(dev, "init-sequence", NULL, 0);
+    if (n <= 0)
+        return 0;
+    seq = kmalloc(n, GFP_KERNEL);
+    /* a record of 2 + len bytes becomes two segments of 1 and len bytes */
+    script = kmalloc(n / 2 * (2 * sizeof(seg) + 1) + n, GFP_KERNEL);
+    if (!seq || !script) {
+        kfree(seq);
+        kfree(script);
+        return -ENOMEM;
+    }
+    device_property_read_u8_array(dev, "init-sequence", seq, n);
+
+    for (pos = 0, p = script; pos < n; pos += 2 + len) {
+        if (n - pos < 2 || n - pos - 2 < seq[pos + 1]) {
+            kfree(seq);
+            kfree(script);
+            return -EINVAL;
+        }
+        len = seq[pos + 1];
+        seg.op = EPAPER_SEG_CMD;
+        seg.len = 1;
+        memcpy(p, &seg, sizeof(seg));
+        p[sizeof(seg)] = seq[pos];
+        p += sizeof(seg) + 1;
+        if (!len)
+            continue;
+        seg.op = EPAPER_SEG_DATA;
+        seg.len = len;
+        memcpy(p, &seg, sizeof(seg));
+        memcpy(p + sizeof(seg), seq + pos + 2, len);
+        p += sizeof(seg) + len;
+    }
+    kfree(seq);
+
+    epd->init_script = script;
+    epd->init_len = p - script;
+    /* nobody initialised it yet, the first job cold starts it as after sleep */
+    epd->asleep = true;
+    return 0;
+}
+
+/*
+ * Every path that talks to the panel holds a runtime PM reference, so
+ * the autosuspend callbacks below never race with bus traffic. Take it
+ * before buf_lock.
+ */
+static int epaper_pm_get(struct epaper_drv_data *epd)
+{
+    struct spi_device *spi;
+    int status;
+
+    spin_lock_irq(&epd->spi_lock);
+    spi = epd->spi;
+    spin_unlock_irq(&epd->spi_lock);
+    if (!spi)
+        return -ESHUTDOWN;
+
+    status = pm_runtime_get_sync(&spi->dev);
+    if (status < 0) {
+        pm_runtime_put_noidle(&spi->dev);
+        return status;
+    }
+    return 0;
+}
+
+static void epaper_pm_put(struct epaper_drv_data *epd)
+{
+    struct spi_device *spi;
+
+    spin_lock_irq(&epd->spi_lock);
+    spi = epd->spi;
+    spin_unlock_irq(&epd->spi_lock);
+    if (!spi)
+        return;
+
+    pm_runtime_mark_last_busy(&spi->dev);
+    pm_runtime_put_autosuspend(&spi->dev);
+}
+
+/*
+ * Send one controller command followed by its parameters. The caller
+ * holds buf_lock.
+ */
+static int
+epaper_write_cmd(struct epaper_drv_data *epd, u8 cmd, const u8 *data, size_t len)
+{
+    struct spi_transfer t = {
+        .tx_buf     = epd->cmd_buf,
+        .len        = 1,
+        .speed_hz   = epd->speed_hz,
+    };
+    struct spi_message m;
+    ssize_t status;
+
+    if (len >= EPAPER_CMD_BUFSIZ)
+        return -EINVAL;
+    epd->cmd_buf[0] = cmd;
+    memcpy(epd->cmd_buf + 1, data, len);
+
+    epaper_set_dc(epd, 0);
+    spi_message_init(&m);
+    spi_message_add_tail(&t, &m);
+    status = epaper_sync(epd, &m);
+    if (status < 0 || !len)
+        return status < 0 ? status : 0;
+
+    epaper_set_dc(epd, 1);
+    t.tx_buf = epd->cmd_buf + 1;
+    t.len = len;
+    spi_message_init(&m);
+    spi_message_add_tail(&t, &m);
+    status = epaper_sync(epd, &m);
+
+    return status < 0 ? status : 0;
+}
+
+static int epaper_refresh(struct epaper_drv_data *epd)
+{
+    u8 mode = 0xC4;
+    int status;
+
+    status = epaper_write_cmd(epd, DISPLAY_UPDATE_CONTROL_2, &mode, 1);
+    if (!status)
+        status = epaper_write_cmd(epd, MASTER_ACTIVATION, NULL, 0);
+    if (!status)
+        status = epaper_write_cmd(epd, TERMINATE_FRAME_READ_WRITE, NULL, 0);
+    if (!status)
+        status = epaper_wait_idle(epd, EPAPER_BUSY_TIMEOUT_MS);
+    return status;
+}
+
+/* only a reset wakes the controller again, see epaper_cold_start() */
+static int epaper_deep_sleep(struct epaper_drv_data *epd)
+{
+    u8 mode = 0x01;
+    int status;
+
+    status = epaper_wait_idle(epd, EPAPER_BUSY_TIMEOUT_MS);
+    if (!status)
+        status = epaper_write_cmd(epd, DEEP_SLEEP_MODE, &mode, 1);
+    epd->ram_valid = false;
+    epd->asleep = true;
+    return status;
+}
+
+/* program the RAM window and address counters for byte columns xs..xe and rows ys..ye */
+static int
+epaper_set_window(struct epaper_drv_data *epd, u32 xs, u32 xe, u32 ys, u32 ye)
+{
+    u8      arg[4];
+    int     status;
+
+    arg[0] = xs;
+    arg[1] = xe;
+    status = epaper_write_cmd(epd, SET_RAM_X_ADDRESS_START_END_POSITION, arg, 2);
+    if (status)
+        return status;
+    arg[0] = ys & 0xFF;
+    arg[1] = (ys >> 8) & 0xFF;
+    arg[2] = ye & 0xFF;
+    arg[3] = (ye >> 8) & 0xFF;
+    status = epaper_write_cmd(epd, SET_RAM_Y_ADDRESS_START_END_POSITION, arg, 4);
+    if (status)
+        return status;
+    /* arg[0..1] still hold ys for the Y counter */
+    status = epaper_write_cmd(epd, SET_RAM_Y_ADDRESS_COUNTER, arg, 2);
+    if (status)
+        return status;
+    arg[0] = xs;
+    status = epaper_write_cmd(epd, SET_RAM_X_ADDRESS_COUNTER, arg, 1);
+    if (status)
+        return status;
+    return epaper_wait_idle(epd, EPAPER_BUSY_TIMEOUT_MS);
+}
+
+/* stream a window out of the RAM copy */
+static int
+epaper_upload_window(struct epaper_drv_data *epd,
+        u32 xs, u32 xe, u32 ys, u32 ye)
+{
+    struct spi_transfer *xfers;
+    struct spi_message  m;
+    u32                 rows = ye - ys + 1;
+    u32                 cols = xe - xs + 1;
+    u32                 y;
+    ssize_t             status;
+
+    status = epaper_set_window(epd, xs, xe, ys, ye);
+    if (status)
+        return status;
+    status = epaper_write_cmd(epd, WRITE_RAM, NULL, 0);
+    if (status)
+        return status;
+
+    /* full-width windows are contiguous in the framebuffer */
+    if (cols == epd->line_length)
+        rows = 1;
+    xfers = kcalloc(rows, sizeof(*xfers), GFP_KERNEL);
+    if (!xfers)
+        return -ENOMEM;
+
+    spi_message_init(&m);
+    for (y = 0; y < rows; y++) {
+        xfers[y].tx_buf = epd->ram + (ys + y) * epd->line_length + xs;
+        xfers[y].len = rows == 1 ? cols * (ye - ys + 1) : cols;
+        xfers[y].speed_hz = epd->speed_hz;
+        spi_message_add_tail(&xfers[y], &m);
+    }
+    epaper_set_dc(epd, 1);
+    status = epaper_sync(epd, &m);
+    kfree(xfers);
+    if (status >= 0)
+        epd->stats.ram_bytes += cols * (ye - ys + 1);
+
+    return status < 0 ? status : 0;
+}
+
+/*
+ * Take a window of the source frame (the shadow framebuffer or a
+ * submitted frame) into the RAM copy before it is sent, so the copy
+ * matches what went out even while userspace keeps drawing into the
+ * mapped framebuffer.
+ */
+static int
+epaper_upload_fb(struct epaper_drv_data *epd, const u8 *src,
+        u32 xs, u32 xe, u32 ys, u32 ye)
+{
+    u32 y;
+
+    for (y = ys; y <= ye; y++)
+        memcpy(epd->ram + y * epd->line_length + xs,
+               src + y * epd->line_length + xs, xe - xs + 1);
+    return epaper_upload_window(epd, xs, xe, ys, ye);
+}
+
+/* byte columns of row y in xs..xe that differ from controller RAM */
+static bool
+epaper_row_diff(struct epaper_drv_data *epd, const u8 *src, u32 y,
+        u32 xs, u32 xe, u32 *lo, u32 *hi)
+{
+    const u8 *a = src + y * epd->line_length;
+    const u8 *b = epd->ram + y * epd->line_length;
+    u32 l = xs, h = xe;
+
+    while (l <= xe && a[l] == b[l])
+        l++;
+    if (l > xe)
+        return false;
+    while (a[h] == b[h])
+        h--;
+    *lo = l;
+    *hi = h;
+    return true;
+}
+
+/*
+ * Upload only the bounding boxes of changed bytes. Dirty rows are
+ * grouped into bands, a band absorbs up to EPAPER_DIFF_GAP clean rows
+ * since every extra window costs its own address setup.
+ */
+static int
+epaper_upload_diff(struct epaper_drv_data *epd, const u8 *src,
+        u32 xs, u32 xe, u32 ys, u32 ye)
+{
+    u32     y, lo, hi, clean = 0;
+    u32     bx0 = 0, bx1 = 0, by0 = 0, by1 = 0;
+    bool    in_band = false, dirty;
+    int     status;
+
+    for (y = ys; y <= ye + 1; y++) {
+        dirty = y <= ye && epaper_row_diff(epd, src, y, xs, xe, &lo, &hi);
+        if (dirty) {
+            if (!in_band) {
+                bx0 = lo;
+                bx1 = hi;
+                by0 = y;
+                in_band = true;
+            } else {
+                bx0 = min(bx0, lo);
+                bx1 = max(bx1, hi);
+            }
+            by1 = y;
+            clean = 0;
+            continue;
+        }
+        if (in_band && (y > ye || ++clean > EPAPER_DIFF_GAP)) {
+            status = epaper_upload_fb(epd, src, bx0, bx1, by0, by1);
+            if (status)
+                return status;
+            in_band = false;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Read a window of controller RAM into dst. The controller answers on
+ * its bidirectional SDA line, so this needs the bus set up for it
+ * (spi-3wire, or MISO tied to SDA). The first byte after READ_RAM is a
+ * dummy.
+ */
+static int
+epaper_read_window(struct epaper_drv_data *epd,
+        u32 xs, u32 xe, u32 ys, u32 ye, u8 *dst)
+{
+    size_t len = (xe - xs + 1) * (ye - ys + 1);
+    struct spi_transfer t = {
+        .len        = len + 1,
+        .speed_hz   = epd->speed_hz,
+    };
+    struct spi_message m;
+    ssize_t status;
+    u8 *rx;
+
+    if (epd->dc_9bit)
+        return -EOPNOTSUPP;
+    rx = kmalloc(len + 1, GFP_KERNEL);
+    if (!rx)
+        return -ENOMEM;
+    t.rx_buf = rx;
+
+    status = epaper_set_window(epd, xs, xe, ys, ye);
+    if (!status)
+        status = epaper_write_cmd(epd, READ_RAM, NULL, 0);
+    if (!status) {
+        epaper_set_dc(epd, 1);
+        spi_message_init(&m);
+        spi_message_add_tail(&t, &m);
+        status = epaper_sync(epd, &m);
+        if (status >= 0) {
+            memcpy(dst, rx + 1, len);
+            status = 0;
+        }
+    }
+    kfree(rx);
+
+    return status;
+}
+
+/* crc32 of a window of the RAM copy */
+static u32 epaper_ram_crc(struct epaper_drv_data *epd, u32 xs, u32 xe,
+        u32 ys, u32 ye)
+{
+    u32 crc = ~0, y;
+
+    for (y = ys; y <= ye; y++)
+        crc = crc32_le(crc, epd->ram + y * epd->line_length + xs, xe - xs + 1);
+    return ~crc;
+}
+
+/*
+ * Read a window back from the controller and compare its crc with the
+ * RAM copy. The readback happens before any refresh, while the RAM is
+ * still what we sent.
+ */
+static int
+epaper_verify_window(struct epaper_drv_data *epd, u32 xs, u32 xe, u32 ys, u32 ye)
+{
+    size_t len = (xe - xs + 1) * (ye - ys + 1);
+    u8 *rb;
+    int status;
+
+    rb = kmalloc(len, GFP_KERNEL);
+    if (!rb)
+        return -ENOMEM;
+    status = epaper_read_window(epd, xs, xe, ys, ye, rb);
+    if (!status && ~crc32_le(~0, rb, len) != epaper_ram_crc(epd, xs, xe, ys, ye))
+        status = -EIO;
+    kfree(rb);
+
+    return status;
+}
+
+static int
+__epaper_flush(struct epaper_drv_data *epd, const u8 *src,
+        const struct epaper_flush *f)
+{
+    u32 x = f->x, y = f->y, w = f->width, h = f->height;
+    u32 xs, xe, ye;
+    int status;
+
+    if (!w || !h) {
+        x = y = 0;
+        w = epd->width;
+        h = epd->height;
+    }
+    if (x >= epd->width || y >= epd->height)
+        return -EINVAL;
+    w = min(w, epd->width - x);
+    h = min(h, epd->height - y);
+
+    xs = x >> 3;
+    xe = (x + w - 1) >> 3;
+    ye = y + h - 1;
+    epd->stats.flush_bytes += (xe - xs + 1) * h;
+
+    if (epd->ram_valid && !(f->flags & EPAPER_FLUSH_FORCE))
+        status = epaper_upload_diff(epd, src, xs, xe, y, ye);
+    else
+        status = epaper_upload_fb(epd, src, xs, xe, y, ye);
+    if (status) {
+        epd->ram_valid = false;
+        return status;
+    }
+
+    /* one resend of the whole window when the readback disagrees */
+    if (f->flags & EPAPER_FLUSH_VERIFY) {
+        status = epaper_verify_window(epd, xs, xe, y, ye);
+        if (status == -EIO) {
+            epd->stats.verify_fail++;
+            status = epaper_upload_window(epd, xs, xe, y, ye);
+            if (!status)
+                status = epaper_verify_window(epd, xs, xe, y, ye);
+        }
+        if (status) {
+            epd->ram_valid = false;
+            return status;
+        }
+    }
+
+    /* a full-frame upload makes the copy trustworthy again */
+    if (xs == 0 && xe == epd->line_length - 1 && h == epd->height)
+        epd->ram_valid = true;
+
+    if (f->flags & EPAPER_FLUSH_REFRESH)
+        status = epaper_refresh(epd);
+    return status;
+}
+
+static int
+epaper_flush(struct epaper_drv_data *epd, const struct epaper_flush *f)
+{
+    return __epaper_flush(epd, epd->fb, f);
+}
+
+/*--------------------------------------------------------------------------*/
+/*
+ * Job queue. A per-device ordered workqueue runs queued jobs one at a
+ * time, highest priority first and in submission order within a
+ * priority. Every job gets a fence when it is queued. A job that
+ * supersedes a queued one (same kind, covering its window) takes it
+ * over, and its fences retire together with the new job. At most
+ * EPAPER_JOB_MAX fences are pending, further submissions get -EAGAIN.
+ *
+ * Raw traffic (write(), read(), streams, the async ring, resets and
+ * the other ioctls that talk to the panel) does not go through the
+ * queue; it waits in epaper_raw_lock() until no job is pending, so it
+ * never lands in the middle of queued work.
+ *
+ * Frames are double-buffered: a slot goes FREE -> FILLING while the
+ * submitter copies into it without holding buf_lock, QUEUED once its
+ * job is queued and BUSY while the worker uploads it.
+ */
+struct epaper_job {
+    struct list_head            node;
+    u32                         type;
+    s32                         prio;
+    struct epaper_flush         rect;
+    struct epaper_frame_slot    *slot;
+    u64                         fence;
+    struct list_head            merged;     /* superseded jobs, for their fences */
+};
+
+static void epaper_job_free(struct epaper_job *job)
+{
+    struct epaper_job *old, *tmp;
+
+    list_for_each_entry_safe(old, tmp, &job->merged, node)
+        kfree(old);
+    kfree(job);
+}
+
+static unsigned int epaper_job_fences(const struct epaper_job *job)
+{
+    const struct epaper_job *old;
+    unsigned int n = 1;
+
+    list_for_each_entry(old, &job->merged, node)
+        n++;
+    return n;
+}
+
+static bool epaper_job_has_fence(const struct epaper_job *job, u64 fence)
+{
+    const struct epaper_job *old;
+
+    if (job->fence == fence)
+        return true;
+    list_for_each_entry(old, &job->merged, node)
+        if (old->fence == fence)
+            return true;
+    return false;
+}
+
+static bool epaper_jobs_idle(struct epaper_drv_data *epd)
+{
+    bool idle;
+
+    spin_lock_irq(&epd->job_lock);
+    idle = list_empty(&epd->jobs) && !epd->job_running;
+    spin_unlock_irq(&epd->job_lock);
+
+    return idle;
+}
+
+/* take buf_lock for raw traffic once the job queue has drained */
+static int epaper_raw_lock(struct epaper_drv_data *epd)
+{
+    int status;
+
+    for (;;) {
+        status = wait_event_interruptible(epd->job_wq, epaper_jobs_idle(epd));
+        if (status)
+            return status;
+        mutex_lock(&epd->buf_lock);
+        if (epaper_jobs_idle(epd))
+            return 0;
+        mutex_unlock(&epd->buf_lock);
+    }
+}
+
+static void epaper_frame_release(struct epaper_drv_data *epd,
+        struct epaper_frame_slot *slot)
+{
+    spin_lock_irq(&epd->job_lock);
+    slot->state = EPAPER_FRAME_FREE;
+    spin_unlock_irq(&epd->job_lock);
+    wake_up_all(&epd->job_wq);
+}
+
+static struct epaper_frame_slot *epaper_frame_claim(struct epaper_drv_data *epd)
+{
+    struct epaper_frame_slot *slot = NULL;
+    int i;
+
+    spin_lock_irq(&epd->job_lock);
+    for (i = 0; i < EPAPER_FRAME_SLOTS; i++) {
+        if (epd->frames[i].state == EPAPER_FRAME_FREE) {
+            slot = &epd->frames[i];
+            slot->state = EPAPER_FRAME_FILLING;
+            break;
+        }
+    }
+    spin_unlock_irq(&epd->job_lock);
+
+    return slot;
+}
+
+static bool epaper_rect_covers(const struct epaper_flush *a,
+        const struct epaper_flush *b)
+{
+    return a->x <= b->x && a->y <= b->y &&
+           a->x + a->width >= b->x + b->width &&
+           a->y + a->height >= b->y + b->height;
+}
+
+/* does queued job old, of the same kind, become redundant once job runs? */
+static bool
+epaper_job_supersedes(const struct epaper_job *job, const struct epaper_job *old)
+{
+    switch (job->type) {
+        case EPAPER_JOB_UPLOAD:
+            /* uploads read the framebuffer when they run */
+            return epaper_rect_covers(&job->rect, &old->rect);
+        case EPAPER_JOB_FRAME:
+        case EPAPER_JOB_REFRESH:
+        case EPAPER_JOB_SLEEP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*
+ * Queue a job and assign its fence, takes ownership of job on success.
+ * -EAGAIN when EPAPER_JOB_MAX fences are pending.
+ */
+static int epaper_job_queue(struct epaper_drv_data *epd,
+        struct epaper_job *job, u64 *fence)
+{
+    struct epaper_job *old, *tmp;
+    struct epaper_frame_slot *freed = NULL;
+    struct list_head *pos;
+
+    spin_lock_irq(&epd->job_lock);
+    if (epd->job_count >= EPAPER_JOB_MAX) {
+        spin_unlock_irq(&epd->job_lock);
+        return -EAGAIN;
+    }
+    epd->job_count++;
+    *fence = job->fence = ++epd->job_seq;
+    /* never pull work past a queued job of another kind */
+    list_for_each_entry_safe_reverse(old, tmp, &epd->jobs, node) {
+        if (old->type != job->type)
+            break;
+        if (!epaper_job_supersedes(job, old))
+            continue;
+        job->prio = max(job->prio, old->prio);
+        job->rect.flags |= old->rect.flags;
+        if (old->slot) {
+            old->slot->state = EPAPER_FRAME_FREE;
+            freed = old->slot;
+            old->slot = NULL;
+        }
+        list_del(&old->node);
+        list_splice_init(&old->merged, &job->merged);
+        list_add_tail(&old->node, &job->merged);
+        epd->stats.jobs_coalesced++;
+    }
+    if (job->slot)
+        job->slot->state = EPAPER_FRAME_QUEUED;
+    list_for_each(pos, &epd->jobs)
+        if (list_entry(pos, struct epaper_job, node)->prio < job->prio)
+            break;
+    list_add_tail(&job->node, pos);
+    spin_unlock_irq(&epd->job_lock);
+
+    if (freed)
+        wake_up_all(&epd->job_wq);
+    queue_work(epd->wq, &epd->job_work);
+    return 0;
+}
+
+static int epaper_job_run(struct epaper_drv_data *epd, struct epaper_job *job)
+{
+    int status;
+
+    status = epaper_pm_get(epd);
+    if (status)
+        return status;
+
+    mutex_lock(&epd->buf_lock);
+    epaper_async_drain(epd);
+    /* a queued job after EPAPER_JOB_SLEEP wakes the panel first */
+    if (epd->asleep && job->type != EPAPER_JOB_SLEEP) {
+        status = epaper_cold_start(epd);
+        if (status)
+            goto out;
+    }
+    switch (job->type) {
+        case EPAPER_JOB_UPLOAD:
+            status = epaper_flush(epd, &job->rect);
+            break;
+        case EPAPER_JOB_FRAME:
+            status = __epaper_flush(epd, job->slot->buf, &job->rect);
+            break;
+        case EPAPER_JOB_REFRESH:
+            status = epaper_refresh(epd);
+            break;
+        case EPAPER_JOB_SLEEP:
+            if (!epd->asleep)
+                status = epaper_deep_sleep(epd);
+            break;
+    }
+out:
+    mutex_unlock(&epd->buf_lock);
+    epaper_pm_put(epd);
+
+    return status;
+}
+
+static void epaper_job_work(struct work_struct *work)
+{
+    struct epaper_drv_data *epd =
+        container_of(work, struct epaper_drv_data, job_work);
+    struct epaper_job *job;
+    int status;
+
+    for (;;) {
+        spin_lock_irq(&epd->job_lock);
+        job = list_first_entry_or_null(&epd->jobs, struct epaper_job, node);
+        if (job) {
+            list_del(&job->node);
+            epd->job_running = job;
+            if (job->slot)
+                job->slot->state = EPAPER_FRAME_BUSY;
+        }
+        spin_unlock_irq(&epd->job_lock);
+        if (!job)
+            break;
+
+        status = epaper_job_run(epd, job);
+
+        spin_lock_irq(&epd->job_lock);
+        epd->job_running = NULL;
+        epd->job_count -= epaper_job_fences(job);
+        if (job->slot)
+            job->slot->state = EPAPER_FRAME_FREE;
+        /* keep a failed job around so all of its fences report the error */
+        if (status) {
+            swap(epd->job_failed, job);
+            epd->job_error = status;
+        }
+        spin_unlock_irq(&epd->job_lock);
+        wake_up_all(&epd->job_wq);
+        if (job)
+            epaper_job_free(job);
+    }
+}
+
+static int
+epaper_job_submit(struct epaper_drv_data *epd, struct epaper_job_req *req)
+{
+    struct epaper_job *job;
+    int status;
+
+    if (req->type > EPAPER_JOB_SLEEP ||
+        req->rect.flags & ~EPAPER_FLUSH_MASK)
+        return -EINVAL;
+
+    job = kzalloc(sizeof(*job), GFP_KERNEL);
+    if (!job)
+        return -ENOMEM;
+    INIT_LIST_HEAD(&job->merged);
+    job->type = req->type;
+    job->prio = req->prio;
+    job->rect = req->rect;
+    /* a zero-sized window is the whole panel, as for EPAPER_FLUSH */
+    if (!job->rect.width || !job->rect.height) {
+        job->rect.x = job->rect.y = 0;
+        job->rect.width = epd->width;
+        job->rect.height = epd->height;
+    }
+    status = epaper_job_queue(epd, job, &req->fence);
+    if (status)
+        kfree(job);
+    return status;
+}
+
+static int
+epaper_frame_submit(struct epaper_drv_data *epd, struct epaper_frame *fr)
+{
+    struct epaper_frame_slot *slot;
+    struct epaper_job *job;
+    int status;
+
+    if (fr->len != epd->line_length * epd->height ||
+        fr->flags & ~EPAPER_FLUSH_MASK)
+        return -EINVAL;
+
+    job = kzalloc(sizeof(*job), GFP_KERNEL);
+    if (!job)
+        return -ENOMEM;
+
+    status = wait_event_interruptible(epd->job_wq,
+                                      (slot = epaper_frame_claim(epd)));
+    if (status) {
+        kfree(job);
+        return status;
+    }
+
+    if (copy_from_user(slot->buf, (void __user *)(uintptr_t)fr->buf,
+                       fr->len)) {
+        epaper_frame_release(epd, slot);
+        kfree(job);
+        return -EFAULT;
+    }
+
+    INIT_LIST_HEAD(&job->merged);
+    job->type = EPAPER_JOB_FRAME;
+    job->slot = slot;
+    job->rect.width = epd->width;
+    job->rect.height = epd->height;
+    job->rect.flags = fr->flags;
+    status = epaper_job_queue(epd, job, &fr->fence);
+    if (status) {
+        epaper_frame_release(epd, slot);
+        kfree(job);
+    }
+    return status;
+}
+
+/* a fence has retired once no queued or running job stands in for it */
+static bool
+epaper_fence_done(struct epaper_drv_data *epd, u64 fence, int *error)
+{
+    struct epaper_job *job;
+    bool done = true;
+
+    spin_lock_irq(&epd->job_lock);
+    job = epd->job_running;
+    if (job && epaper_job_has_fence(job, fence))
+        done = false;
+    list_for_each_entry(job, &epd->jobs, node)
+        if (epaper_job_has_fence(job, fence))
+            done = false;
+    *error = done && epd->job_failed &&
+             epaper_job_has_fence(epd->job_failed, fence) ? epd->job_error : 0;
+    spin_unlock_irq(&epd->job_lock);
+
+    return done;
+}
+
+/*
+ * Returns the error of the job that carried out the fence if it was the
+ * most recent one to fail. A timeout of MAX_SCHEDULE_TIMEOUT jiffies
+ * waits forever.
+ */
+static int
+epaper_fence_wait(struct epaper_drv_data *epd, u64 fence, long timeout)
+{
+    int error = 0;
+    long ret;
+
+    spin_lock_irq(&epd->job_lock);
+    ret = fence > epd->job_seq;
+    spin_unlock_irq(&epd->job_lock);
+    if (ret)
+        return -EINVAL;
+
+    ret = wait_event_interruptible_timeout(epd->job_wq,
+                epaper_fence_done(epd, fence, &error), timeout);
+    if (ret < 0)
+        return ret;
+    if (!ret)
+        return -ETIMEDOUT;
+    return error;
+}
+
+/* EPAPER_READ_RAM: copy a window of controller RAM to userspace */
+static int epaper_read_ram(struct epaper_drv_data *epd, struct epaper_ram_read *r)
+{
+    u32 x = r->x, y = r->y, w = r->width, h = r->height;
+    u32 xs, xe, ye;
+    size_t len;
+    u8 *buf;
+    int status;
+
+    if (!w || !h) {
+        x = y = 0;
+        w = epd->width;
+        h = epd->height;
+    }
+    if (x >= epd->width || y >= epd->height)
+        return -EINVAL;
+    w = min(w, epd->width - x);
+    h = min(h, epd->height - y);
+    xs = x >> 3;
+    xe = (x + w - 1) >> 3;
+    ye = y + h - 1;
+    len = (xe - xs + 1) * h;
+    if (r->len < len)
+        return -EMSGSIZE;
+
+    buf = kmalloc(len, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+    status = epaper_read_window(epd, xs, xe, y, ye, buf);
+    if (!status && copy_to_user((void __user *)(uintptr_t)r->buf, buf, len))
+        status = -EFAULT;
+    if (!status) {
+        r->len = len;
+        r->crc = ~crc32_le(~0, buf, len);
+    }
+    kfree(buf);
+
+    return status;
+}
+
+static int epaper_check_speed(struct epaper_drv_data *epd, u32 hz)
+{
+    struct spi_master *master = epd->spi->master;
+
+    if (!hz || (master->max_speed_hz && hz > master->max_speed_hz) ||
+        hz < master->min_speed_hz)
+        return -EINVAL;
+    return 0;
+}
+
+/*
+ * spi-max-frequency is only where the panel starts. Like spidev's
+ * SPI_IOC_WR_MAX_SPEED_HZ, a faster rate raises the device limit too,
+ * so the SPI core does not clamp transfers back to it.
+ */
+static int epaper_set_speed(struct epaper_drv_data *epd, u32 hz)
+{
+    struct spi_device *spi;
+    u32 saved;
+    int status;
+
+    spin_lock_irq(&epd->spi_lock);
+    spi = epd->spi;
+    spin_unlock_irq(&epd->spi_lock);
+    if (!spi)
+        return -ESHUTDOWN;
+
+    status = epaper_check_speed(epd, hz);
+    if (status)
+        return status;
+    if (hz > spi->max_speed_hz) {
+        saved = spi->max_speed_hz;
+        spi->max_speed_hz = hz;
+        status = spi_setup(spi);
+        if (status < 0) {
+            spi->max_speed_hz = saved;
+            return status;
+        }
+    }
+    epd->speed_hz = hz;
+    return 0;
+}
+
+/* write a pattern to the first rows of controller RAM and read it back */
+static int epaper_verify_speed(struct epaper_drv_data *epd, u8 *pattern,
+        u8 *readback, size_t len)
+{
+    struct spi_transfer t = {
+        .tx_buf     = pattern,
+        .len        = len,
+        .speed_hz   = epd->speed_hz,
+    };
+    struct spi_message m;
+    u32 rows = len / epd->line_length;
+    ssize_t status;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        pattern[i] = (i * 7 + epd->speed_hz / 1000) ^ 0xA5;
+
+    status = epaper_set_window(epd, 0, epd->line_length - 1, 0, rows - 1);
+    if (!status)
+        status = epaper_write_cmd(epd, WRITE_RAM, NULL, 0);
+    if (status)
+        return status;
+    epaper_set_dc(epd, 1);
+    spi_message_init(&m);
+    spi_message_add_tail(&t, &m);
+    status = epaper_sync(epd, &m);
+    if (status < 0)
+        return status;
+
+    status = epaper_read_window(epd, 0, epd->line_length - 1, 0, rows - 1,
+                                readback);
+    if (status)
+        return status;
+    return memcmp(pattern, readback, len) ? -EIO : 0;
+}
+
+static int
+epaper_speed_selftest(struct epaper_drv_data *epd, struct epaper_selftest *st)
+{
+    size_t len = EPAPER_SELFTEST_ROWS * epd->line_length;
+    u32 saved = epd->speed_hz, saved_max = epd->spi->max_speed_hz, hz;
+    u8 *pattern, *readback;
+    int status = 0;
+
+    if (!st->step_hz || st->min_hz > st->max_hz ||
+        epaper_check_speed(epd, st->min_hz))
+        return -EINVAL;
+
+    pattern = kmalloc(len, GFP_KERNEL);
+    readback = kmalloc(len, GFP_KERNEL);
+    if (!pattern || !readback) {
+        status = -ENOMEM;
+        goto out;
+    }
+
+    /* the pattern lands in controller RAM */
+    epd->ram_valid = false;
+    st->best_hz = 0;
+    for (hz = st->min_hz; hz <= st->max_hz; hz += st->step_hz) {
+        if (epaper_set_speed(epd, hz))
+            break;
+        status = epaper_verify_speed(epd, pattern, readback, len);
+        if (status)
+            break;
+        st->best_hz = hz;
+        if (st->max_hz - hz < st->step_hz)
+            break;
+    }
+    /* a failed verify only ends the ramp */
+    if (status == -EIO)
+        status = 0;
+out:
+    /* the ramp only reports, EPAPER_SET_SPEED applies a rate */
+    epd->speed_hz = saved;
+    if (epd->spi->max_speed_hz != saved_max) {
+        epd->spi->max_speed_hz = saved_max;
+        spi_setup(epd->spi);
+    }
+    kfree(pattern);
+    kfree(readback);
 
     return status;
 }
 
-static inline ssize_t
-epaper_sync_write(struct epaper_drv_data *epd, size_t len)
+static bool epaper_can_zerocopy(struct epaper_drv_data *epd, struct iov_iter *from)
 {
-    struct spi_transfer t = {
-        .tx_buf     = epd->tx_buffer,
-        .len        = len,
-        .speed_hz   = epd->speed_hz,
-    };
-    struct spi_message m;
+    /* transfers point into the linear map, so no highmem */
+    return !IS_ENABLED(CONFIG_HIGHMEM) && zerocopy_min && !epd->dc_9bit &&
+           iter_is_iovec(from) && iov_iter_count(from) >= zerocopy_min;
+}
 
-    spi_message_init(&m);
-    spi_message_add_tail(&t, &m);
-    return epaper_sync(epd, &m);
+/*
+ * Send user memory in place: pin up to EPAPER_ZC_PAGES pages at a time
+ * and point one spi_transfer at each, so the controller maps the user
+ * pages for DMA instead of the CPU copying them into tx_buffer.
+ *
+ * Bytes sent are added to *sent. Memory that cannot be pinned stops the
+ * loop with 0 and the rest of the iterator is left for the copy path;
+ * a failed transfer returns its error.
+ */
+static int
+epaper_write_zerocopy(struct epaper_drv_data *epd, struct iov_iter *from,
+        ssize_t *sent)
+{
+    struct spi_message  m;
+    ssize_t             bytes, status = 0;
+    size_t              start, left;
+    unsigned            i, npages;
+    u64                 t0;
+
+    while (iov_iter_count(from)) {
+        t0 = ktime_get_ns();
+        bytes = iov_iter_get_pages(from, epd->zc_pages, iov_iter_count(from),
+                                   EPAPER_ZC_PAGES, &start);
+        if (bytes <= 0)
+            return 0;
+        npages = DIV_ROUND_UP(start + bytes, PAGE_SIZE);
+
+        spi_message_init(&m);
+        for (i = 0, left = bytes; i < npages; i++) {
+            struct spi_transfer *t = &epd->zc_xfers[i];
+
+            memset(t, 0, sizeof(*t));
+            t->tx_buf = page_address(epd->zc_pages[i]) + start;
+            t->len = min_t(size_t, left, PAGE_SIZE - start);
+            t->speed_hz = epd->speed_hz;
+            left -= t->len;
+            start = 0;
+            spi_message_add_tail(t, &m);
+        }
+        epd->stats.zc_ns += ktime_get_ns() - t0;
+
+        status = epaper_sync(epd, &m);
+        for (i = 0; i < npages; i++)
+            put_page(epd->zc_pages[i]);
+        if (status < 0)
+            return status;
+        iov_iter_advance(from, bytes);
+        epd->stats.zc_bytes += bytes;
+        *sent += status;
+    }
+
+    return 0;
 }
 
-static inline ssize_t
-epaper_sync_read(struct epaper_drv_data *epd, size_t len)
+/*
+ * Raw traffic is watched for commands so that only writes that can
+ * change controller RAM drop the shadow copy EPAPER_FLUSH diffs
+ * against: data after WRITE_RAM or after a command not listed here.
+ */
+static bool epaper_cmd_keeps_ram(int cmd)
 {
-    struct spi_transfer t = {
-        .rx_buf     = epd->rx_buffer,
-        .len        = len,
-        .speed_hz   = epd->speed_hz,
-    };
-    struct spi_message m;
+    switch (cmd) {
+        case DRIVER_OUTPUT_CONTROL:
+        case BOOSTER_SOFT_START_CONTROL:
+        case DATA_ENTRY_MODE_SETTING:
+        case MASTER_ACTIVATION:
+        case DISPLAY_UPDATE_CONTROL_2:
+        case WRITE_VCOM_REGISTER:
+        case WRITE_LUT_REGISTER:
+        case SET_DUMMY_LINE_PERIOD:
+        case SET_RAM_X_ADDRESS_START_END_POSITION:
+        case SET_RAM_Y_ADDRESS_START_END_POSITION:
+        case SET_RAM_X_ADDRESS_COUNTER:
+        case SET_RAM_Y_ADDRESS_COUNTER:
+        case TERMINATE_FRAME_READ_WRITE:
+            return true;
+        default:
+            return false;
+    }
+}
 
-    spi_message_init(&m);
-    spi_message_add_tail(&t, &m);
-    return epaper_sync(epd, &m);
+static void epaper_raw_cmds(struct epaper_drv_data *epd, const u8 *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        epd->raw_cmd = buf[i];
+        if (buf[i] != WRITE_RAM && !epaper_cmd_keeps_ram(buf[i]))
+            epd->ram_valid = false;
+    }
 }
 
+/*
+ * Writes of any size, including writev() of several user buffers, are
+ * sent under one buf_lock hold, so a whole frame goes out in a single
+ * syscall. Large user buffers are sent zero-copy, the rest is streamed
+ * through tx_buffer in bufsiz chunks.
+ */
 static ssize_t
-epaper_write(struct file *filp, const char __user *buf,
-        size_t count, loff_t *f_pos)
+epaper_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-    struct epaper_drv_data *epd;
-    ssize_t             status = 0;
-    unsigned long          missing;
+    struct epaper_file  *ef = iocb->ki_filp->private_data;
+    struct epaper_drv_data *epd = ef->epd;
+    ssize_t             status = 0, sent = 0;
+    size_t              n, prefix = 0;
+    int                 dc = ef->dc_level;
+    u64                 t0;
+    u8                  level;
 
-    if(count > bufsiz)
-        return -EMSGSIZE;
-    
-    epd = filp->private_data;
+    if (ef->write_mode == EPAPER_WRITE_DC_PREFIX) {
+        /* like any other write(), zero bytes is not an error */
+        if (!iov_iter_count(from))
+            return 0;
+        if (copy_from_iter(&level, 1, from) != 1)
+            return -EFAULT;
+        if (level > 1)
+            return -EINVAL;
+        dc = level;
+        prefix = 1;
+    }
 
-    mutex_lock(&epd->buf_lock);
-    missing = copy_from_user(epd->tx_buffer, buf, count);
-    if(missing == 0)
-        status = epaper_sync_write(epd, count);
-    else
-        status = -EFAULT;
+    status = epaper_pm_get(epd);
+    if (status)
+        return status;
+    status = epaper_raw_lock(epd);
+    if (status) {
+        epaper_pm_put(epd);
+        return status;
+    }
+    epaper_async_drain(epd);
+    /*
+     * Raw data is not diffed, the window it lands in was set up by
+     * earlier writes. It only drops the RAM shadow when it may land in
+     * RAM, so EPAPER_FLUSH keeps diffing across raw refreshes and LUT
+     * or window setup, see epaper_cmd_keeps_ram().
+     */
+    if (dc && (epd->raw_seq != epd->sync_seq ||
+               !epaper_cmd_keeps_ram(epd->raw_cmd)))
+        epd->ram_valid = false;
+    epaper_set_dc(epd, dc);
+    if (epaper_can_zerocopy(epd, from)) {
+        /* commands sent zero-copy are not looked at */
+        if (!dc) {
+            epd->raw_cmd = -1;
+            epd->ram_valid = false;
+        }
+        status = epaper_write_zerocopy(epd, from, &sent);
+    }
+    while (status >= 0 && iov_iter_count(from)) {
+        n = min_t(size_t, iov_iter_count(from), bufsiz);
+        t0 = ktime_get_ns();
+        if (copy_from_iter(epd->tx_buffer, n, from) != n) {
+            status = -EFAULT;
+            break;
+        }
+        epd->stats.copy_ns += ktime_get_ns() - t0;
+        epd->stats.copy_bytes += n;
+        if (!dc)
+            epaper_raw_cmds(epd, epd->tx_buffer, n);
+        status = epaper_sync_write(epd, n);
+        if (status < 0)
+            break;
+        sent += status;
+    }
+    epd->raw_seq = epd->sync_seq;
     mutex_unlock(&epd->buf_lock);
+    epaper_pm_put(epd);
 
-    return status;
+    return status < 0 && !sent ? status : sent + prefix;
 }
 
 static ssize_t
@@ -130,15 +2018,26 @@ epaper_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
 {
     /* @@ should't use this function @@ */
     /* @@ use for debug @@*/
+    struct epaper_file *ef;
     struct epaper_drv_data *epd;
     ssize_t          status = 0;
 
     if (count > bufsiz)
         return -EMSGSIZE;
     
-    epd = filp->private_data;
+    ef = filp->private_data;
+    epd = ef->epd;
 
-    mutex_lock(&epd->buf_lock);
+    status = epaper_pm_get(epd);
+    if (status)
+        return status;
+    status = epaper_raw_lock(epd);
+    if (status) {
+        epaper_pm_put(epd);
+        return status;
+    }
+    epaper_async_drain(epd);
+    epaper_set_dc(epd, ef->dc_level);
     status = epaper_sync_read(epd, count);
     if (status > 0) {
         unsigned long missing;
@@ -149,6 +2048,7 @@ epaper_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
             status = status - missing;
     }
     mutex_unlock(&epd->buf_lock);
+    epaper_pm_put(epd);
 
     return status;
 }
@@ -156,9 +2056,18 @@ epaper_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
 static int epaper_open(struct inode *inode, struct file *filp)
 {
     struct epaper_drv_data *epd;
+    struct epaper_file     *ef;
     int            status = -ENXIO;
 
-    epd = epaper_drv_data_p;
+    ef = kzalloc(sizeof(*ef), GFP_KERNEL);
+    if (!ef)
+        return -ENOMEM;
+    ef->dc_level = 1;
+
+    mutex_lock(&device_list_lock);
+    epd = idr_find(&epaper_minors, iminor(inode));
+    if (!epd)
+        goto err_find_dev;
 
     if(!epd->tx_buffer) {
         epd->tx_buffer = kmalloc(bufsiz, GFP_KERNEL);
@@ -178,9 +2087,17 @@ static int epaper_open(struct inode *inode, struct file *filp)
         }
     }
 
+    /* no autosuspend while the panel is open, see epaper_runtime_suspend() */
+    spin_lock_irq(&epd->spi_lock);
+    if (epd->spi)
+        pm_runtime_get_noresume(&epd->spi->dev);
+    spin_unlock_irq(&epd->spi_lock);
     epd->users++;
-    filp->private_data = epd;
+    kref_get(&epd->kref);
+    ef->epd = epd;
+    filp->private_data = ef;
     nonseekable_open(inode, filp);
+    mutex_unlock(&device_list_lock);
 
     return 0;
 
@@ -188,88 +2105,683 @@ err_alloc_rx_buf:
     kfree(epd->tx_buffer);
     epd->tx_buffer = NULL;
 err_alloc_tx_buf:
+err_find_dev:
+    mutex_unlock(&device_list_lock);
+    kfree(ef);
     return status;
 }
 
 static int epaper_release(struct inode *inode, struct file *filp)
 {
     struct epaper_drv_data *epd;
+    struct spi_device *spi;
 
-    epd = filp->private_data;
+    mutex_lock(&device_list_lock);
+    epd = ((struct epaper_file *)filp->private_data)->epd;
+    kfree(filp->private_data);
     filp->private_data = NULL;
 
     epd->users--;
     if(!epd->users) {
-        int     dofree;
-
         kfree(epd->tx_buffer);
         epd->tx_buffer = NULL;
 
         kfree(epd->rx_buffer);
         epd->rx_buffer = NULL;
-
-        spin_lock_irq(&epd->spi_lock);
-        if(epd->spi)
-            epd->speed_hz = epd->spi->max_speed_hz;
-        
-        dofree = (epd->spi == NULL);
-        spin_unlock_irq(&epd->spi_lock);
-
-        if(dofree)
-            kfree(epd);
     }
+    /* remove() dropped the references of files still open at the time */
+    spin_lock_irq(&epd->spi_lock);
+    spi = epd->spi;
+    spin_unlock_irq(&epd->spi_lock);
+    if (spi) {
+        pm_runtime_mark_last_busy(&spi->dev);
+        pm_runtime_put_autosuspend(&spi->dev);
+    }
+    kref_put(&epd->kref, epaper_kref_release);
+    mutex_unlock(&device_list_lock);
 
     return 0;
 }
 
+/*
+ * 1 for the commands of the main switch that talk to the panel, 0 for
+ * those that only touch driver state, -ENOTTY for anything else.
+ */
+static int epaper_ioctl_needs_hw(unsigned int cmd)
+{
+    switch (cmd) {
+        case EPAPER_RESET:
+        case EPAPER_SUBMIT_STREAM:
+        case EPAPER_SET_INIT:
+        case EPAPER_READ_RAM:
+        case EPAPER_SPEED_SELFTEST:
+            return 1;
+        case EPAPER_GET_INFO:
+        case EPAPER_GET_SPEED:
+        case EPAPER_SET_SPEED:
+        case EPAPER_GET_RESET_TIMING:
+        case EPAPER_SET_RESET_TIMING:
+        case EPAPER_ASYNC_STATUS:
+        case EPAPER_ASYNC_SET_EVENTFD:
+        case EPAPER_DC_PIN_SET_HIGH:
+        case EPAPER_DC_PIN_SET_LOW:
+            return 0;
+        default:
+            return -ENOTTY;
+    }
+}
+
 static long
 epaper_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     int                 retval = 0;
-    struct epaper_drv_data    *epd;
+    struct epaper_file      *ef = filp->private_data;
+    struct epaper_drv_data    *epd = ef->epd;
+    struct epaper_stream    stream;
+    struct epaper_info      info;
+    struct epaper_async     async;
+    struct epaper_async_status  async_status;
+    struct epaper_selftest  selftest;
+    struct epaper_reset_timing reset_timing;
+    struct epaper_ram_read  ram_read;
+    u32                 speed;
+    s32                 fd;
+    u8                  *buf;
+    int                 hw;
 
     if (_IOC_TYPE(cmd) != EPAPER_MAGIC)
         return -ENOTTY;
 
-    epd = filp->private_data;
+    if (cmd == EPAPER_SET_WRITE_MODE) {
+        u32 mode;
 
-    mutex_lock(&epd->buf_lock);
+        if (get_user(mode, (u32 __user *)arg))
+            return -EFAULT;
+        if (mode > EPAPER_WRITE_DC_PREFIX)
+            return -EINVAL;
+        ef->write_mode = mode;
+        return 0;
+    }
+
+    /*
+     * Legacy busy polls must not wait out queued work: pending jobs
+     * count as busy, otherwise the pin is read as it is.
+     */
+    if (cmd == EPAPER_IS_DEV_BUSY) {
+        retval = !epaper_jobs_idle(epd) || gpio_get_value(epd->busy_gpio);
+        trace_epaper_busy(MINOR(epd->devt), retval);
+        return retval;
+    }
+    /* waiting for idle must not hold off other users of buf_lock */
+    if (cmd == EPAPER_WAIT_IDLE) {
+        u32 timeout;
+
+        if (get_user(timeout, (u32 __user *)arg))
+            return -EFAULT;
+        return epaper_wait_idle(epd, timeout);
+    }
+    /* frames are copied and waited for without buf_lock, see epaper_frame_submit() */
+    if (cmd == EPAPER_SUBMIT_FRAME) {
+        struct epaper_frame fr;
+
+        if (copy_from_user(&fr, (void __user *)arg, sizeof(fr)))
+            return -EFAULT;
+        retval = epaper_frame_submit(epd, &fr);
+        if (!retval && put_user(fr.fence,
+                                &((struct epaper_frame __user *)arg)->fence))
+            retval = -EFAULT;
+        return retval;
+    }
+    if (cmd == EPAPER_WAIT_FENCE) {
+        struct epaper_fence_wait w;
+
+        if (copy_from_user(&w, (void __user *)arg, sizeof(w)))
+            return -EFAULT;
+        return epaper_fence_wait(epd, w.fence, msecs_to_jiffies(w.timeout_ms));
+    }
+    if (cmd == EPAPER_QUEUE_JOB) {
+        struct epaper_job_req req;
+
+        if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+            return -EFAULT;
+        retval = epaper_job_submit(epd, &req);
+        if (!retval && put_user(req.fence,
+                                &((struct epaper_job_req __user *)arg)->fence))
+            retval = -EFAULT;
+        return retval;
+    }
+    /* the slot wait must not hold off other users of buf_lock */
+    if (cmd == EPAPER_ASYNC_SUBMIT) {
+        if (copy_from_user(&async, (void __user *)arg, sizeof(async)))
+            return -EFAULT;
+        if (!async.len)
+            return -EINVAL;
+        if (async.len > bufsiz)
+            return -EMSGSIZE;
+        retval = epaper_pm_get(epd);
+        if (retval)
+            return retval;
+        retval = epaper_async_lock_slot(epd, filp->f_flags & O_NONBLOCK);
+        if (!retval) {
+            epd->ram_valid = false;
+            epd->raw_cmd = -1;
+            retval = epaper_async_submit(epd, &async);
+            mutex_unlock(&epd->buf_lock);
+        }
+        epaper_pm_put(epd);
+        if (!retval && copy_to_user((void __user *)arg, &async, sizeof(async)))
+            retval = -EFAULT;
+        return retval;
+    }
+    /* flushes go through the job queue so they order with queued jobs */
+    if (cmd == EPAPER_FLUSH) {
+        struct epaper_job_req req = { .type = EPAPER_JOB_UPLOAD };
+
+        if (copy_from_user(&req.rect, (void __user *)arg, sizeof(req.rect)))
+            return -EFAULT;
+        if (req.rect.width && req.rect.height &&
+            (req.rect.x >= epd->width || req.rect.y >= epd->height))
+            return -EINVAL;
+        retval = epaper_job_submit(epd, &req);
+        if (retval)
+            return retval;
+        return epaper_fence_wait(epd, req.fence, MAX_SCHEDULE_TIMEOUT);
+    }
+
+    hw = epaper_ioctl_needs_hw(cmd);
+    if (hw < 0)
+        return hw;
+    if (hw) {
+        retval = epaper_pm_get(epd);
+        if (retval)
+            return retval;
+        retval = epaper_raw_lock(epd);
+        if (retval) {
+            epaper_pm_put(epd);
+            return retval;
+        }
+    } else {
+        mutex_lock(&epd->buf_lock);
+    }
+    if (cmd != EPAPER_ASYNC_STATUS)
+        epaper_async_drain(epd);
     switch (cmd)
     {
-        case EPAPER_IS_DEV_BUSY:
-            retval = gpio_get_value(epd->busy_gpio);
-            break;
+        /* the pin follows on the next write() or read() of this file */
         case EPAPER_DC_PIN_SET_HIGH:
-            gpio_set_value(epd->dc_gpio, 1);
+            ef->dc_level = 1;
+            trace_epaper_dc(MINOR(epd->devt), 1);
             break;
         case EPAPER_DC_PIN_SET_LOW:
-            gpio_set_value(epd->dc_gpio, 0);
+            ef->dc_level = 0;
+            trace_epaper_dc(MINOR(epd->devt), 0);
             break;
         case EPAPER_RESET:
-            gpio_set_value(epd->reset_gpio, 0);
-            msleep(200);
-            gpio_set_value(epd->reset_gpio, 1);
-            msleep(200);
+            retval = epaper_cold_start(epd);
+            break;
+        case EPAPER_GET_RESET_TIMING:
+            if (copy_to_user((void __user *)arg, &epd->reset_timing,
+                             sizeof(epd->reset_timing)))
+                retval = -EFAULT;
+            break;
+        case EPAPER_SET_RESET_TIMING:
+            if (copy_from_user(&reset_timing, (void __user *)arg,
+                               sizeof(reset_timing)))
+                retval = -EFAULT;
+            else if (reset_timing.flags & ~EPAPER_RESET_WAIT_BUSY ||
+                     reset_timing.reserved ||
+                     !epaper_reset_ms_valid(reset_timing.low_ms) ||
+                     !epaper_reset_ms_valid(reset_timing.high_ms))
+                retval = -EINVAL;
+            else
+                epd->reset_timing = reset_timing;
+            break;
+        case EPAPER_SUBMIT_STREAM:
+            if (copy_from_user(&stream, (void __user *)arg, sizeof(stream))) {
+                retval = -EFAULT;
+                break;
+            }
+            if (stream.len > EPAPER_STREAM_MAX) {
+                retval = -EMSGSIZE;
+                break;
+            }
+            buf = memdup_user((void __user *)(uintptr_t)stream.buf, stream.len);
+            if (IS_ERR(buf)) {
+                retval = PTR_ERR(buf);
+                break;
+            }
+            epd->ram_valid = false;
+            retval = epaper_run_stream(epd, buf, stream.len);
+            kfree(buf);
+            break;
+        case EPAPER_SET_INIT:
+            if (copy_from_user(&stream, (void __user *)arg, sizeof(stream))) {
+                retval = -EFAULT;
+                break;
+            }
+            if (stream.len > EPAPER_STREAM_MAX) {
+                retval = -EMSGSIZE;
+                break;
+            }
+            buf = memdup_user((void __user *)(uintptr_t)stream.buf, stream.len);
+            if (IS_ERR(buf)) {
+                retval = PTR_ERR(buf);
+                break;
+            }
+            retval = epaper_set_init(epd, buf, stream.len);
+            break;
+        case EPAPER_GET_INFO:
+            info.width = epd->width;
+            info.height = epd->height;
+            info.line_length = epd->line_length;
+            info.fb_size = epd->fb_size;
+            if (copy_to_user((void __user *)arg, &info, sizeof(info)))
+                retval = -EFAULT;
+            break;
+        case EPAPER_ASYNC_STATUS:
+            epaper_async_get_status(epd, &async_status);
+            if (copy_to_user((void __user *)arg, &async_status,
+                             sizeof(async_status)))
+                retval = -EFAULT;
+            break;
+        case EPAPER_ASYNC_SET_EVENTFD:
+            if (get_user(fd, (s32 __user *)arg))
+                retval = -EFAULT;
+            else
+                retval = epaper_async_set_eventfd(epd, fd);
+            break;
+        case EPAPER_READ_RAM:
+            if (copy_from_user(&ram_read, (void __user *)arg, sizeof(ram_read)))
+                retval = -EFAULT;
+            else
+                retval = epaper_read_ram(epd, &ram_read);
+            if (!retval && copy_to_user((void __user *)arg, &ram_read,
+                                        sizeof(ram_read)))
+                retval = -EFAULT;
+            break;
+        case EPAPER_GET_SPEED:
+            retval = put_user(epd->speed_hz, (u32 __user *)arg);
+            break;
+        case EPAPER_SET_SPEED:
+            if (get_user(speed, (u32 __user *)arg))
+                retval = -EFAULT;
+            else
+                retval = epaper_set_speed(epd, speed);
+            break;
+        case EPAPER_SPEED_SELFTEST:
+            if (copy_from_user(&selftest, (void __user *)arg, sizeof(selftest))) {
+                retval = -EFAULT;
+                break;
+            }
+            retval = epaper_speed_selftest(epd, &selftest);
+            if (!retval && copy_to_user((void __user *)arg, &selftest,
+                                        sizeof(selftest)))
+                retval = -EFAULT;
             break;
         default:
             retval = -EINVAL;
             break;
     }
     mutex_unlock(&epd->buf_lock);
+    if (hw)
+        epaper_pm_put(epd);
 
     return retval;
 }
 
+/*
+ * remap_pfn_range() takes no page references, so every mapping pins
+ * epd and with it fb until the last one is unmapped.
+ */
+static void epaper_vm_open(struct vm_area_struct *vma)
+{
+    struct epaper_drv_data *epd = vma->vm_private_data;
+
+    kref_get(&epd->kref);
+}
+
+static void epaper_vm_close(struct vm_area_struct *vma)
+{
+    struct epaper_drv_data *epd = vma->vm_private_data;
+
+    mutex_lock(&device_list_lock);
+    kref_put(&epd->kref, epaper_kref_release);
+    mutex_unlock(&device_list_lock);
+}
+
+static const struct vm_operations_struct epaper_vm_ops = {
+    .open   = epaper_vm_open,
+    .close  = epaper_vm_close,
+};
+
+static int epaper_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct epaper_drv_data *epd =
+        ((struct epaper_file *)filp->private_data)->epd;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;
+    int status;
+
+    if (offset >= epd->fb_size || size > epd->fb_size - offset)
+        return -EINVAL;
+
+    status = remap_pfn_range(vma, vma->vm_start,
+                (virt_to_phys(epd->fb) + offset) >> PAGE_SHIFT,
+                size, vma->vm_page_prot);
+    if (status)
+        return status;
+    vma->vm_ops = &epaper_vm_ops;
+    vma->vm_private_data = epd;
+    epaper_vm_open(vma);
+    return 0;
+}
+
+/*
+ * POLLOUT means the panel is idle. Without a BUSY interrupt nothing
+ * wakes the poll table, so only non-blocking polls are meaningful.
+ * POLLIN means async submissions completed since EPAPER_ASYNC_STATUS
+ * was last queried.
+ */
+static unsigned int epaper_poll(struct file *filp, poll_table *wait)
+{
+    struct epaper_drv_data *epd =
+        ((struct epaper_file *)filp->private_data)->epd;
+    unsigned int mask = 0;
+    unsigned long flags;
+
+    poll_wait(filp, &epd->idle_wq, wait);
+    poll_wait(filp, &epd->async_wq, wait);
+    if (!gpio_get_value(epd->busy_gpio))
+        mask |= POLLOUT | POLLWRNORM;
+
+    spin_lock_irqsave(&epd->async_lock, flags);
+    if (epd->async_done != epd->async_reported)
+        mask |= POLLIN | POLLRDNORM;
+    spin_unlock_irqrestore(&epd->async_lock, flags);
+
+    return mask;
+}
+
 static const struct file_operations epaper_fops = {
     .owner = THIS_MODULE,
-    .write = epaper_write,
+    .write_iter = epaper_write_iter,
     .unlocked_ioctl = epaper_ioctl,
+    .compat_ioctl = epaper_ioctl,
     .read = epaper_read,
+    .mmap = epaper_mmap,
+    .poll = epaper_poll,
     .open = epaper_open,
     .release  = epaper_release,
     .llseek = no_llseek,
 };
+/*---------------------------------------------------------------------------*/
+#ifdef EPAPER_FBDEV
+/*
+ * fbdev front end. fbdev packs the leftmost pixel into the LSB, the
+ * controller wants it in the MSB, so clients draw into their own
+ * vmalloc screen and damaged rows are bit-reversed into the shadow
+ * framebuffer before being flushed. Rows touched through mmap are
+ * found from the deferred-io page list, other drawing records its
+ * rows with epaper_fb_damage().
+ */
+static void epaper_fb_damage(struct fb_info *info, u32 y, u32 h)
+{
+    struct epaper_drv_data *epd = info->par;
+    unsigned long flags;
+
+    spin_lock_irqsave(&epd->fb_damage_lock, flags);
+    epd->fb_damage_y0 = min(epd->fb_damage_y0, y);
+    epd->fb_damage_y1 = max(epd->fb_damage_y1, y + h);
+    spin_unlock_irqrestore(&epd->fb_damage_lock, flags);
+
+    schedule_delayed_work(&info->deferred_work, info->fbdefio->delay);
+}
+
+static void
+epaper_fb_deferred_io(struct fb_info *info, struct list_head *pagelist)
+{
+    struct epaper_drv_data *epd = info->par;
+    struct epaper_job_req req = {
+        .type = EPAPER_JOB_UPLOAD,
+        .rect.flags = EPAPER_FLUSH_REFRESH,
+    };
+    struct page *page;
+    const u8 *init;
+    int status;
+    unsigned long flags;
+    u32 y0, y1, i;
+
+    spin_lock_irqsave(&epd->fb_damage_lock, flags);
+    y0 = epd->fb_damage_y0;
+    y1 = epd->fb_damage_y1;
+    epd->fb_damage_y0 = U32_MAX;
+    epd->fb_damage_y1 = 0;
+    spin_unlock_irqrestore(&epd->fb_damage_lock, flags);
+
+    list_for_each_entry(page, pagelist, lru) {
+        y0 = min_t(u32, y0, (page->index << PAGE_SHIFT) / epd->line_length);
+        y1 = max_t(u32, y1, DIV_ROUND_UP((page->index + 1) << PAGE_SHIFT,
+                                         epd->line_length));
+    }
+    y1 = min(y1, epd->height);
+    if (y0 >= y1)
+        return;
+
+    /* a running upload job reads fb under buf_lock */
+    mutex_lock(&epd->buf_lock);
+    for (i = y0 * epd->line_length; i < y1 * epd->line_length; i++)
+        epd->fb[i] = bitrev8(epd->fb_screen[i]);
+    init = epd->init_script;
+    mutex_unlock(&epd->buf_lock);
+
+    /* the driver has no init sequence of its own, see epaper_cold_start() */
+    if (!init) {
+        dev_warn_ratelimited(info->dev,
+                "panel not initialised, needs init-sequence or EPAPER_SET_INIT\n");
+        return;
+    }
+
+    /* queued like EPAPER_FLUSH, so it orders with the other jobs */
+    req.rect.y = y0;
+    req.rect.width = epd->width;
+    req.rect.height = y1 - y0;
+    status = epaper_job_submit(epd, &req);
+    if (status == -EAGAIN)
+        epaper_fb_damage(info, y0, y1 - y0);
+    else if (status)
+        dev_warn(info->dev, "framebuffer flush failed\n");
+}
+
+static ssize_t epaper_fb_write(struct fb_info *info, const char __user *buf,
+        size_t count, loff_t *ppos)
+{
+    struct epaper_drv_data *epd = info->par;
+    loff_t pos = *ppos;
+    ssize_t ret;
+
+    ret = fb_sys_write(info, buf, count, ppos);
+    if (ret > 0)
+        epaper_fb_damage(info, pos / epd->line_length,
+                         DIV_ROUND_UP(ret, epd->line_length) + 1);
+    return ret;
+}
+
+static void epaper_fb_fillrect(struct fb_info *info,
+        const struct fb_fillrect *rect)
+{
+    sys_fillrect(info, rect);
+    epaper_fb_damage(info, rect->dy, rect->height);
+}
+
+static void epaper_fb_copyarea(struct fb_info *info,
+        const struct fb_copyarea *area)
+{
+    sys_copyarea(info, area);
+    epaper_fb_damage(info, area->dy, area->height);
+}
+
+static void epaper_fb_imageblit(struct fb_info *info,
+        const struct fb_image *image)
+{
+    sys_imageblit(info, image);
+    epaper_fb_damage(info, image->dy, image->height);
+}
+
+static const struct fb_ops epaper_fb_ops = {
+    .owner          = THIS_MODULE,
+    .fb_read        = fb_sys_read,
+    .fb_write       = epaper_fb_write,
+    .fb_fillrect    = epaper_fb_fillrect,
+    .fb_copyarea    = epaper_fb_copyarea,
+    .fb_imageblit   = epaper_fb_imageblit,
+};
+
+static int epaper_fb_register(struct epaper_drv_data *epd, struct device *dev)
+{
+    struct fb_info *info;
+    int ret;
+
+    epd->fb_screen = vmalloc(epd->fb_size);
+    if (!epd->fb_screen)
+        return -ENOMEM;
+    /* FB_VISUAL_MONO10: set bits are white, like the controller */
+    memset(epd->fb_screen, 0xFF, epd->fb_size);
+
+    info = framebuffer_alloc(0, dev);
+    if (!info) {
+        ret = -ENOMEM;
+        goto err_free_screen;
+    }
+    spin_lock_init(&epd->fb_damage_lock);
+    epd->fb_damage_y0 = U32_MAX;
+    epd->fb_damage_y1 = 0;
+
+    /* fb_deferred_io_init() patches fb_mmap, so each panel has its own ops */
+    epd->fb_ops = epaper_fb_ops;
+    epd->fb_defio.delay = msecs_to_jiffies(fbdev_delay_ms);
+    epd->fb_defio.deferred_io = epaper_fb_deferred_io;
+
+    info->par = epd;
+    info->fbops = &epd->fb_ops;
+    info->fbdefio = &epd->fb_defio;
+    info->screen_base = (char __iomem *)epd->fb_screen;
+    info->screen_size = epd->fb_size;
+    info->flags = FBINFO_DEFAULT | FBINFO_VIRTFB;
+
+    strlcpy(info->fix.id, "epaper", sizeof(info->fix.id));
+    info->fix.type = FB_TYPE_PACKED_PIXELS;
+    info->fix.visual = FB_VISUAL_MONO10;
+    info->fix.line_length = epd->line_length;
+    info->fix.smem_len = epd->fb_size;
+    info->fix.accel = FB_ACCEL_NONE;
+
+    info->var.xres = info->var.xres_virtual = epd->width;
+    info->var.yres = info->var.yres_virtual = epd->height;
+    info->var.bits_per_pixel = 1;
+    info->var.grayscale = 1;
+    info->var.red.length = info->var.green.length = info->var.blue.length = 1;
+    info->var.activate = FB_ACTIVATE_NOW;
+
+    fb_deferred_io_init(info);
+    ret = register_framebuffer(info);
+    if (ret < 0)
+        goto err_release;
+    epd->fb_info = info;
+    dev_info(dev, "registered fb%d\n", info->node);
+
+    return 0;
+
+err_release:
+    fb_deferred_io_cleanup(info);
+    framebuffer_release(info);
+err_free_screen:
+    vfree(epd->fb_screen);
+    epd->fb_screen = NULL;
+    return ret;
+}
+
+static void epaper_fb_unregister(struct epaper_drv_data *epd)
+{
+    if (!epd->fb_info)
+        return;
+    unregister_framebuffer(epd->fb_info);
+    fb_deferred_io_cleanup(epd->fb_info);
+    framebuffer_release(epd->fb_info);
+    epd->fb_info = NULL;
+    vfree(epd->fb_screen);
+    epd->fb_screen = NULL;
+}
+#else
+static inline void epaper_fb_unregister(struct epaper_drv_data *epd)
+{
+}
+#endif
+
+/*--------------------------------------------------------------------------*/
+/*
+ * Runtime PM: every open file holds a reference, so a panel only
+ * suspends autosuspend_ms after its last close. Suspend sends it to
+ * deep sleep, the next access resets it and replays the init script.
+ * Without an EPAPER_SET_INIT script there is nothing to restore the
+ * client's setup with, so such panels are never suspended. No locking
+ * needed, see epaper_pm_get().
+ */
+static int __maybe_unused epaper_runtime_suspend(struct device *dev)
+{
+    struct epaper_drv_data *epd = spi_get_drvdata(to_spi_device(dev));
+
+    if (!epd->init_script)
+        return -EBUSY;
+    return epaper_deep_sleep(epd);
+}
+
+static int __maybe_unused epaper_runtime_resume(struct device *dev)
+{
+    struct epaper_drv_data *epd = spi_get_drvdata(to_spi_device(dev));
+
+    return epaper_cold_start(epd);
+}
+
+static const struct dev_pm_ops epaper_pm_ops = {
+    SET_RUNTIME_PM_OPS(epaper_runtime_suspend, epaper_runtime_resume, NULL)
+};
+
 /*--------------------------------------------------------------------------*/
+static int epaper_sync_avg_get(void *data, u64 *val)
+{
+    struct epaper_drv_data *epd = data;
+
+    *val = epd->stats.messages ?
+           div64_u64(epd->stats.sync_ns, epd->stats.messages) : 0;
+    return 0;
+}
+DEFINE_SIMPLE_ATTRIBUTE(epaper_sync_avg_fops, epaper_sync_avg_get, NULL, "%llu\n");
+
+static void epaper_debugfs_init(struct epaper_drv_data *epd, const char *name)
+{
+    struct dentry *d;
+
+    d = debugfs_create_dir(name, epaper_debugfs_root);
+    if (IS_ERR_OR_NULL(d))
+        return;
+    epd->debugfs = d;
+    debugfs_create_u64("tx_bytes", S_IRUGO, d, &epd->stats.tx_bytes);
+    debugfs_create_u64("messages", S_IRUGO, d, &epd->stats.messages);
+    debugfs_create_file("sync_avg_ns", S_IRUGO, d, epd, &epaper_sync_avg_fops);
+    debugfs_create_u64("sync_max_ns", S_IRUGO, d, &epd->stats.sync_max_ns);
+    debugfs_create_u64("busy_ns", S_IRUGO, d, &epd->stats.busy_ns);
+    debugfs_create_u64("resets", S_IRUGO, d, &epd->stats.resets);
+    debugfs_create_u64("copy_bytes", S_IRUGO, d, &epd->stats.copy_bytes);
+    debugfs_create_u64("copy_ns", S_IRUGO, d, &epd->stats.copy_ns);
+    debugfs_create_u64("zerocopy_bytes", S_IRUGO, d, &epd->stats.zc_bytes);
+    debugfs_create_u64("zerocopy_ns", S_IRUGO, d, &epd->stats.zc_ns);
+    debugfs_create_u64("flush_bytes", S_IRUGO, d, &epd->stats.flush_bytes);
+    debugfs_create_u64("ram_bytes", S_IRUGO, d, &epd->stats.ram_bytes);
+    debugfs_create_u64("jobs_coalesced", S_IRUGO, d,
+                       &epd->stats.jobs_coalesced);
+    debugfs_create_u64("verify_fail", S_IRUGO, d, &epd->stats.verify_fail);
+}
+
 static int epaper_spi_probe(struct spi_device *spi)
 {
     struct epaper_drv_data      *epd;
@@ -278,56 +2790,205 @@ static int epaper_spi_probe(struct spi_device *spi)
                                 *reset,
                                 *dc;
     struct device               *dev;
+    int                         i, minor, irq;
+    bool                        dc_9bit;
 
-    spi->bits_per_word = 8;
+    dc_9bit = device_property_read_bool(&spi->dev, "dc-9bit");
+    spi->bits_per_word = dc_9bit ? 9 : 8;
     spi->mode = SPI_MODE_0;
     err = spi_setup(spi);
+    if (err < 0 && dc_9bit) {
+        dev_warn(&spi->dev, "no 9-bit words, using the DC GPIO\n");
+        dc_9bit = false;
+        spi->bits_per_word = 8;
+        err = spi_setup(spi);
+    }
     if(err < 0)
         return err;
     epd = kzalloc(sizeof(struct epaper_drv_data), GFP_KERNEL);
     if(!epd)
         return -ENOMEM;
+    kref_init(&epd->kref);
+    epd->busy_gpio = epd->dc_gpio = epd->reset_gpio = -1;
+    /* the node is live before the IRQ is requested, poll until then */
+    epd->busy_irq = -1;
+    epd->raw_cmd = -1;
     epd->spi = spi;
+    epd->speed_hz = spi->max_speed_hz;
+    epd->dc_9bit = dc_9bit;
+    spi_set_drvdata(spi, epd);
     spin_lock_init(&epd->spi_lock);
     mutex_init(&epd->buf_lock);
-    epd->devt = MKDEV(EPAPER_SPI_MAJOR, 0);
-    dev = device_create(epaper_class, &spi->dev, epd->devt,
-                            epd, "epaper_spi_dev");
-    printk("%s:name=%s,bus_num=%d,cs=%d,mode=%d,speed=%d\n",__func__,
-            spi->modalias, spi->master->bus_num, spi->chip_select,
-            spi->mode, spi->max_speed_hz);
-    busy    = devm_gpiod_get(&spi->dev, "busy", GPIOD_IN);
-    dc      = devm_gpiod_get(&spi->dev, "dc", GPIOD_OUT_HIGH);
-    reset   = devm_gpiod_get(&spi->dev, "reset", GPIOD_OUT_HIGH);
-    if(!busy && !dc && !reset) {
+    init_waitqueue_head(&epd->idle_wq);
+    spin_lock_init(&epd->async_lock);
+    init_waitqueue_head(&epd->async_wq);
+    spin_lock_init(&epd->job_lock);
+    init_waitqueue_head(&epd->job_wq);
+    INIT_LIST_HEAD(&epd->jobs);
+    INIT_WORK(&epd->job_work, epaper_job_work);
+    INIT_WORK(&epd->async_work, epaper_async_work);
+
+    epd->width = EPAPER_DEFAULT_WIDTH;
+    epd->height = EPAPER_DEFAULT_HEIGHT;
+    device_property_read_u32(&spi->dev, "width", &epd->width);
+    device_property_read_u32(&spi->dev, "height", &epd->height);
+    epd->reset_timing.low_ms = EPAPER_DEFAULT_RESET_MS;
+    epd->reset_timing.high_ms = EPAPER_DEFAULT_RESET_MS;
+    device_property_read_u32(&spi->dev, "reset-low-ms",
+                             &epd->reset_timing.low_ms);
+    device_property_read_u32(&spi->dev, "reset-high-ms",
+                             &epd->reset_timing.high_ms);
+    if (!epaper_reset_ms_valid(epd->reset_timing.low_ms) ||
+        !epaper_reset_ms_valid(epd->reset_timing.high_ms)) {
+        dev_warn(&spi->dev, "reset-low-ms/reset-high-ms out of range, using %u ms\n",
+                 EPAPER_DEFAULT_RESET_MS);
+        epd->reset_timing.low_ms = EPAPER_DEFAULT_RESET_MS;
+        epd->reset_timing.high_ms = EPAPER_DEFAULT_RESET_MS;
+    }
+    if (device_property_read_bool(&spi->dev, "reset-wait-busy"))
+        epd->reset_timing.flags |= EPAPER_RESET_WAIT_BUSY;
+    epd->line_length = DIV_ROUND_UP(epd->width, 8);
+    epd->fb_size = PAGE_ALIGN(epd->line_length * epd->height);
+    epd->cmd_buf = kmalloc(EPAPER_CMD_BUFSIZ, GFP_KERNEL);
+    epd->fb = alloc_pages_exact(epd->fb_size, GFP_KERNEL);
+    epd->ram = kmalloc(epd->line_length * epd->height, GFP_KERNEL);
+    epd->wq = alloc_ordered_workqueue("epaper%d", 0, spi->chip_select);
+    if (!epd->cmd_buf || !epd->fb || !epd->ram || !epd->wq) {
+        err = -ENOMEM;
+        goto out;
+    }
+    for (i = 0; i < EPAPER_FRAME_SLOTS; i++) {
+        epd->frames[i].buf = kmalloc(epd->line_length * epd->height,
+                                     GFP_KERNEL);
+        if (!epd->frames[i].buf) {
+            err = -ENOMEM;
+            goto out;
+        }
+    }
+    for (i = 0; i < EPAPER_ASYNC_SLOTS; i++) {
+        epd->async[i].epd = epd;
+        epd->async[i].buf = kmalloc(dc_9bit ? 2 * bufsiz : bufsiz,
+                                    GFP_KERNEL);
+        if (!epd->async[i].buf) {
+            err = -ENOMEM;
+            goto out;
+        }
+    }
+    /* controller RAM bits are 1 for white */
+    memset(epd->fb, 0xFF, epd->fb_size);
+
+    err = epaper_init_from_fw(epd, &spi->dev);
+    if (err == -EINVAL)
+        dev_warn(&spi->dev, "malformed init-sequence, ignored\n");
+    else if (err)
+        goto out;
+    err = 0;
+
+    /* not devm: the pins are released by epaper_free(), after the last close */
+    busy    = gpiod_get(&spi->dev, "busy", GPIOD_IN);
+    dc      = dc_9bit ? gpiod_get_optional(&spi->dev, "dc", GPIOD_OUT_HIGH) :
+                        gpiod_get(&spi->dev, "dc", GPIOD_OUT_HIGH);
+    reset   = gpiod_get(&spi->dev, "reset", GPIOD_OUT_HIGH);
+    if (!IS_ERR(busy))
+        epd->busy_gpio = desc_to_gpio(busy);
+    if (!IS_ERR_OR_NULL(dc))
+        epd->dc_gpio = desc_to_gpio(dc);
+    if (!IS_ERR(reset))
+        epd->reset_gpio = desc_to_gpio(reset);
+    if(IS_ERR(busy) || IS_ERR(dc) || IS_ERR(reset)) {
         err = -ENODEV;
         goto out;
     }
-    epd->busy_gpio   = desc_to_gpio(busy);
-    epd->dc_gpio     = desc_to_gpio(dc);
-    epd->reset_gpio  = desc_to_gpio(reset);
+
+    mutex_lock(&device_list_lock);
+    minor = idr_alloc(&epaper_minors, epd, 0, N_SPI_MINORS, GFP_KERNEL);
+    if (minor < 0) {
+        mutex_unlock(&device_list_lock);
+        dev_err(&spi->dev, "no minor number available\n");
+        err = minor == -ENOSPC ? -ENODEV : minor;
+        goto out;
+    }
+    epd->devt = MKDEV(EPAPER_SPI_MAJOR, minor);
+    dev = device_create(epaper_class, &spi->dev, epd->devt,
+                            epd, "epaper_spi_dev%d", minor);
+    if (IS_ERR(dev)) {
+        idr_remove(&epaper_minors, minor);
+        mutex_unlock(&device_list_lock);
+        err = PTR_ERR(dev);
+        goto out;
+    }
+    mutex_unlock(&device_list_lock);
+    printk("%s:name=%s,bus_num=%d,cs=%d,mode=%d,speed=%d,minor=%d\n",__func__,
+            spi->modalias, spi->master->bus_num, spi->chip_select,
+            spi->mode, spi->max_speed_hz, minor);
+
+    /* only publish the IRQ once it is requested, see __epaper_wait_idle() */
+    irq = gpiod_to_irq(busy);
+    if (irq >= 0 &&
+        !devm_request_irq(&spi->dev, irq, epaper_busy_irq,
+                          IRQF_TRIGGER_FALLING, "epaper-busy", epd))
+        WRITE_ONCE(epd->busy_irq, irq);
+    else
+        dev_info(&spi->dev, "no BUSY interrupt, polling for idle\n");
+
+#ifdef EPAPER_FBDEV
+    if (fbdev && epaper_fb_register(epd, &spi->dev) < 0)
+        dev_warn(&spi->dev, "failed to register framebuffer\n");
+#endif
+    epaper_debugfs_init(epd, dev_name(&spi->dev));
+
+    /* the panel is powered and initialised by its user, as before */
+    pm_runtime_set_autosuspend_delay(&spi->dev, autosuspend_ms);
+    pm_runtime_use_autosuspend(&spi->dev);
+    pm_runtime_get_noresume(&spi->dev);
+    pm_runtime_set_active(&spi->dev);
+    pm_runtime_enable(&spi->dev);
+    pm_runtime_mark_last_busy(&spi->dev);
+    pm_runtime_put_autosuspend(&spi->dev);
 out:
-    if (err == 0) {
-        spi_set_drvdata(spi, epd);
-        epaper_drv_data_p = epd;
-    } else
-        kfree(epd);
+    if (err)
+        epaper_free(epd);
     return err;
 }
 
 static int epaper_spi_remove(struct spi_device *spi)
 {
     struct epaper_drv_data *epd = spi_get_drvdata(spi);
+    unsigned i;
+
+    epaper_fb_unregister(epd);
 
+    mutex_lock(&epd->buf_lock);
+    epaper_async_drain(epd);
+    mutex_unlock(&epd->buf_lock);
+    flush_workqueue(epd->wq);
+
+    pm_runtime_disable(&spi->dev);
+    pm_runtime_dont_use_autosuspend(&spi->dev);
+    pm_runtime_set_suspended(&spi->dev);
+
+    debugfs_remove_recursive(epd->debugfs);
+    if (epd->busy_irq >= 0) {
+        devm_free_irq(&spi->dev, epd->busy_irq, epd);
+        /* later waits poll the pin, which stays requested until the free */
+        epd->busy_irq = -1;
+        wake_up_interruptible(&epd->idle_wq);
+    }
+
+    mutex_lock(&device_list_lock);
+    /* make sure ops on existing fds can abort cleanly */
     spin_lock_irq(&epd->spi_lock);
     epd->spi = NULL;
-    epaper_drv_data_p = NULL;
     spin_unlock_irq(&epd->spi_lock);
+    /* the runtime PM references of files still open, see epaper_open() */
+    for (i = 0; i < epd->users; i++)
+        pm_runtime_put_noidle(&spi->dev);
+
+    /* prevent new opens, the last close or munmap frees epd */
+    idr_remove(&epaper_minors, MINOR(epd->devt));
     device_destroy(epaper_class, epd->devt);
-    devm_gpiod_put(&spi->dev, gpio_to_desc(epd->reset_gpio));
-    devm_gpiod_put(&spi->dev, gpio_to_desc(epd->dc_gpio));
-    devm_gpiod_put(&spi->dev, gpio_to_desc(epd->busy_gpio));
-    kfree(epd);
+    kref_put(&epd->kref, epaper_kref_release);
+    mutex_unlock(&device_list_lock);
 
     return 0;
 }
@@ -337,6 +2998,7 @@ static struct spi_driver epaper_spi_driver = {
         .name =         "epaper_spi",
         .owner =        THIS_MODULE,
         .of_match_table = of_match_ptr(epaper_dt_ids),
+        .pm =           &epaper_pm_ops,
      },
     .probe =        epaper_spi_probe,
     .remove =       epaper_spi_remove,
@@ -354,9 +3016,11 @@ static int __init epaper_spi_init(void)
         unregister_chrdev(EPAPER_SPI_MAJOR, epaper_spi_driver.driver.name);
         return PTR_ERR(epaper_class);
     }
+    epaper_debugfs_root = debugfs_create_dir("epaper_spi", NULL);
 
     status = spi_register_driver(&epaper_spi_driver);
     if(status < 0) {
+        debugfs_remove_recursive(epaper_debugfs_root);
         class_destroy(epaper_class);
         unregister_chrdev(EPAPER_SPI_MAJOR, epaper_spi_driver.driver.name);
     }
@@ -367,6 +3031,8 @@ module_init(epaper_spi_init);
 static void __exit epaper_spi_exit(void)
 {
     spi_unregister_driver(&epaper_spi_driver);
+    idr_destroy(&epaper_minors);
+    debugfs_remove_recursive(epaper_debugfs_root);
     class_destroy(epaper_class);
     unregister_chrdev(EPAPER_SPI_MAJOR, epaper_spi_driver.driver.name);
 }
@@ -0,0 +1,106 @@
+/**
+ * SHOOTERX1 <yorha.a2@foxmail.com>
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM epaper
+
+#if !defined(_EPAPER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _EPAPER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(epaper_sync_start,
+    TP_PROTO(int minor, unsigned len),
+    TP_ARGS(minor, len),
+    TP_STRUCT__entry(
+        __field(int,        minor)
+        __field(unsigned,   len)
+    ),
+    TP_fast_assign(
+        __entry->minor  = minor;
+        __entry->len    = len;
+    ),
+    TP_printk("dev%d len=%u", __entry->minor, __entry->len)
+);
+
+TRACE_EVENT(epaper_sync_done,
+    TP_PROTO(int minor, int status, u64 ns),
+    TP_ARGS(minor, status, ns),
+    TP_STRUCT__entry(
+        __field(int,        minor)
+        __field(int,        status)
+        __field(u64,        ns)
+    ),
+    TP_fast_assign(
+        __entry->minor  = minor;
+        __entry->status = status;
+        __entry->ns     = ns;
+    ),
+    TP_printk("dev%d status=%d ns=%llu", __entry->minor, __entry->status,
+              (unsigned long long)__entry->ns)
+);
+
+TRACE_EVENT(epaper_dc,
+    TP_PROTO(int minor, int level),
+    TP_ARGS(minor, level),
+    TP_STRUCT__entry(
+        __field(int,        minor)
+        __field(int,        level)
+    ),
+    TP_fast_assign(
+        __entry->minor  = minor;
+        __entry->level  = level;
+    ),
+    TP_printk("dev%d dc=%d", __entry->minor, __entry->level)
+);
+
+TRACE_EVENT(epaper_reset,
+    TP_PROTO(int minor),
+    TP_ARGS(minor),
+    TP_STRUCT__entry(
+        __field(int,        minor)
+    ),
+    TP_fast_assign(
+        __entry->minor  = minor;
+    ),
+    TP_printk("dev%d", __entry->minor)
+);
+
+TRACE_EVENT(epaper_busy,
+    TP_PROTO(int minor, int busy),
+    TP_ARGS(minor, busy),
+    TP_STRUCT__entry(
+        __field(int,        minor)
+        __field(int,        busy)
+    ),
+    TP_fast_assign(
+        __entry->minor  = minor;
+        __entry->busy   = busy;
+    ),
+    TP_printk("dev%d busy=%d", __entry->minor, __entry->busy)
+);
+
+TRACE_EVENT(epaper_wait_idle_done,
+    TP_PROTO(int minor, int status, u64 ns),
+    TP_ARGS(minor, status, ns),
+    TP_STRUCT__entry(
+        __field(int,        minor)
+        __field(int,        status)
+        __field(u64,        ns)
+    ),
+    TP_fast_assign(
+        __entry->minor  = minor;
+        __entry->status = status;
+        __entry->ns     = ns;
+    ),
+    TP_printk("dev%d status=%d ns=%llu", __entry->minor, __entry->status,
+              (unsigned long long)__entry->ns)
+);
+
+#endif /* _EPAPER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE epaper_trace
+#include <trace/define_trace.h>
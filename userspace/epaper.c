@@ -50,7 +50,8 @@ int main(void)
     struct epd_paint *paint;
     if ((epd = epd_create_epaper()) == NULL)
         return -ENOMEM;
-    epd_init_epaper(epd, lut_full_update);
+    if (epd_init_epaper(epd, lut_full_update) < 0)
+        return -EIO;
     if ((paint = epdpaint_init_with_exist_image_array(epd->width, epd->height,
                 ROTATE_0, epaper_background,
                 ARRAY_SIZE(epaper_background))) == NULL)
@@ -0,0 +1,198 @@
+/**
+ *  Copyright (C) Waveshare     July 28 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documnetation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to  whom the Software is
+ * furished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS OR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/**
+ * Rewritten to apply to C language
+ * SHOOTERX1 <yorha.a2@foxmail.com>
+ */
+/**
+ * ================================================================
+ * epaper_chardev.c     ----  transport file
+ * talks to the epaper_spi kernel driver through its device node.
+ * ================================================================
+ */
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "epaper_core.h"
+#include "epaper_cmds.h"
+#include "epaper_transport.h"
+
+/* the driver's shadow framebuffer, NULL when it could not be mapped */
+struct chardev_priv {
+    unsigned char *fb;
+    size_t fb_size;
+    unsigned int line_length;
+};
+
+/*
+ * With EPAPER_WRITE_DC_PREFIX the DC level rides in the first byte of
+ * the write, so one writev() per run. Older drivers need the DC ioctl.
+ */
+static int chardev_write(struct epd_s *e, int dc, const unsigned char *buf, size_t len)
+{
+    unsigned char prefix = dc;
+    struct iovec iov[2];
+    ssize_t n;
+
+    if (e->dc_prefix) {
+        iov[0].iov_base = &prefix;
+        iov[0].iov_len = 1;
+        iov[1].iov_base = (void *)buf;
+        iov[1].iov_len = len;
+        n = writev(e->fd, iov, 2);
+        return n == (ssize_t)len + 1 ? 0 : -1;
+    }
+    if (ioctl(e->fd, dc ? EPAPER_DC_PIN_SET_HIGH : EPAPER_DC_PIN_SET_LOW) < 0)
+        return -errno;
+    n = write(e->fd, buf, len);
+    return n == (ssize_t)len ? 0 : -1;
+}
+
+static int chardev_reset(struct epd_s *e)
+{
+    return ioctl(e->fd, EPAPER_RESET) < 0 ? -errno : 0;
+}
+
+static int chardev_is_busy(struct epd_s *e)
+{
+    int ret = ioctl(e->fd, EPAPER_IS_DEV_BUSY);
+
+    if (ret < 0)
+        return -errno;
+    return ret == EPD_BUSY;
+}
+
+static int chardev_wait_idle(struct epd_s *e, unsigned int timeout_ms)
+{
+    int ret;
+
+    if (ioctl(e->fd, EPAPER_WAIT_IDLE, &timeout_ms) == 0)
+        return 0;
+    if (errno != EINVAL)
+        return -errno;
+    /* driver without EPAPER_WAIT_IDLE */
+    while ((ret = chardev_is_busy(e)) > 0)
+        epd_delay_ms(100);  // 100ms
+    return ret;
+}
+
+static int chardev_set_init(struct epd_s *e, const void *stream, size_t len)
+{
+    (void)len;
+    return ioctl(e->fd, EPAPER_SET_INIT, stream) < 0 ? -errno : 0;
+}
+
+/*
+ * Frames go through the mmap'ed framebuffer and EPAPER_FLUSH, so the
+ * driver only sends the rows that differ from what the panel holds.
+ */
+static int chardev_upload(struct epd_s *e, const unsigned char *buf,
+        int stride, const struct epd_rect *r)
+{
+    struct chardev_priv *p = e->priv;
+    struct epaper_flush f = {
+        .x = r->x, .y = r->y, .width = r->width, .height = r->height,
+    };
+
+    if (!p)
+        return -ENOTTY;
+    for (int j = 0; j < r->height; j++)
+        memcpy(p->fb + (r->y + j) * p->line_length + r->x / 8,
+               buf + j * stride, r->width / 8);
+    return ioctl(e->fd, EPAPER_FLUSH, &f) < 0 ? -errno : 0;
+}
+
+static void chardev_close(struct epd_s *e)
+{
+    struct chardev_priv *p = e->priv;
+
+    if (p) {
+        munmap(p->fb, p->fb_size);
+        free(p);
+    }
+    close(e->fd);
+}
+
+/* older drivers have no framebuffer, uploads then stay plain writes */
+static void chardev_map_fb(struct epd_s *e)
+{
+    struct epaper_info info;
+    struct chardev_priv *p;
+    void *fb;
+
+    if (ioctl(e->fd, EPAPER_GET_INFO, &info) < 0 ||
+        (int)info.width != e->width || (int)info.height != e->height)
+        return;
+    fb = mmap(NULL, info.fb_size, PROT_READ | PROT_WRITE, MAP_SHARED, e->fd, 0);
+    if (fb == MAP_FAILED)
+        return;
+    p = malloc(sizeof(*p));
+    if (!p) {
+        munmap(fb, info.fb_size);
+        return;
+    }
+    p->fb = fb;
+    p->fb_size = info.fb_size;
+    p->line_length = info.line_length;
+    e->priv = p;
+}
+
+static const struct epd_transport_ops chardev_ops = {
+    .name      = "chardev",
+    .write     = chardev_write,
+    .reset     = chardev_reset,
+    .is_busy   = chardev_is_busy,
+    .wait_idle = chardev_wait_idle,
+    .set_init  = chardev_set_init,
+    .upload    = chardev_upload,
+    .close     = chardev_close,
+};
+
+struct epd_s *epd_create_epaper_dev(const char *path)
+{
+    struct epd_s *e;
+    unsigned int mode;
+
+    e = epd_alloc(&chardev_ops);
+    if (!e)
+        return NULL;
+    /* a shared writable mapping needs the node open for reading too */
+    e->fd = open(path, O_RDWR);
+    if (e->fd < 0)
+        e->fd = open(path, O_WRONLY);
+    if (e->fd < 0) {
+        free(e);
+        return NULL;
+    }
+    mode = EPAPER_WRITE_DC_PREFIX;
+    e->dc_prefix = ioctl(e->fd, EPAPER_SET_WRITE_MODE, &mode) == 0;
+    chardev_map_fb(e);
+    return e;
+}
@@ -5,6 +5,7 @@
 #define EPAPER_CMDS_H
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define EPAPER_MAGIC 0x25
 
@@ -12,5 +13,225 @@
 #define EPAPER_DC_PIN_SET_HIGH          _IO(EPAPER_MAGIC, 1)
 #define EPAPER_DC_PIN_SET_LOW           _IO(EPAPER_MAGIC, 2)
 #define EPAPER_RESET                    _IO(EPAPER_MAGIC, 3)
+#define EPAPER_SUBMIT_STREAM            _IOW(EPAPER_MAGIC, 4, struct epaper_stream)
+#define EPAPER_GET_INFO                 _IOR(EPAPER_MAGIC, 5, struct epaper_info)
+#define EPAPER_FLUSH                    _IOW(EPAPER_MAGIC, 6, struct epaper_flush)
+/* block until BUSY drops; takes a __u32 timeout in ms */
+#define EPAPER_WAIT_IDLE                _IOW(EPAPER_MAGIC, 7, __u32)
+#define EPAPER_ASYNC_SUBMIT             _IOWR(EPAPER_MAGIC, 8, struct epaper_async)
+#define EPAPER_ASYNC_STATUS             _IOR(EPAPER_MAGIC, 9, struct epaper_async_status)
+/* signal an eventfd on every async completion; takes an __s32 fd, -1 detaches */
+#define EPAPER_ASYNC_SET_EVENTFD        _IOW(EPAPER_MAGIC, 10, __s32)
+#define EPAPER_GET_SPEED                _IOR(EPAPER_MAGIC, 11, __u32)
+#define EPAPER_SET_SPEED                _IOW(EPAPER_MAGIC, 12, __u32)
+#define EPAPER_SPEED_SELFTEST           _IOWR(EPAPER_MAGIC, 13, struct epaper_selftest)
+/*
+ * Replace the panel init script (a stream, see below) and run it after a
+ * hardware reset. Until then the script comes from the board's
+ * init-sequence property, if it has one. The driver keeps the script
+ * and replays it after every EPAPER_RESET and when the panel wakes from
+ * deep sleep. Only panels with a script are put to sleep by runtime PM,
+ * and only once no file has them open.
+ */
+#define EPAPER_SET_INIT                 _IOW(EPAPER_MAGIC, 14, struct epaper_stream)
+#define EPAPER_GET_RESET_TIMING         _IOR(EPAPER_MAGIC, 15, struct epaper_reset_timing)
+#define EPAPER_SET_RESET_TIMING         _IOW(EPAPER_MAGIC, 16, struct epaper_reset_timing)
+/* queue a whole frame for upload, returns its fence in epaper_frame.fence */
+#define EPAPER_SUBMIT_FRAME             _IOWR(EPAPER_MAGIC, 17, struct epaper_frame)
+#define EPAPER_WAIT_FENCE               _IOW(EPAPER_MAGIC, 18, struct epaper_fence_wait)
+#define EPAPER_QUEUE_JOB                _IOWR(EPAPER_MAGIC, 19, struct epaper_job_req)
+/*
+ * Per open file. In EPAPER_WRITE_DC_PREFIX mode the first byte of every
+ * write() selects DC for the rest of it (0 command, 1 data), and the
+ * driver sets DC and sends the payload under one lock hold. In the
+ * default EPAPER_WRITE_RAW mode writes use the level last set through
+ * EPAPER_DC_PIN_SET_* on the same file.
+ */
+#define EPAPER_SET_WRITE_MODE           _IOW(EPAPER_MAGIC, 20, __u32)
+
+#define EPAPER_WRITE_RAW                0
+#define EPAPER_WRITE_DC_PREFIX          1
+
+#define EPAPER_READ_RAM                 _IOWR(EPAPER_MAGIC, 21, struct epaper_ram_read)
+
+/*
+ * A stream is a packed list of segments: a struct epaper_seg header
+ * followed by `len` payload bytes (none for EPAPER_SEG_WAIT_IDLE).
+ * Consecutive cmd/data segments with the same DC level are sent as
+ * one spi_message.
+ */
+#define EPAPER_SEG_CMD                  0
+#define EPAPER_SEG_DATA                 1
+#define EPAPER_SEG_WAIT_IDLE            2
+#define EPAPER_SEG_DELAY                3   /* payload: __u16 milliseconds */
+
+#define EPAPER_STREAM_MAX               (64 * 1024)
+
+struct epaper_seg {
+    __u8    op;
+    __u8    reserved;
+    __u16   len;
+};
+
+struct epaper_stream {
+    __u64   buf;        /* user pointer to the packed segments */
+    __u32   len;        /* total length in bytes */
+    __u32   reserved;
+};
+
+/*
+ * Geometry of the 1bpp shadow framebuffer exposed through mmap().
+ * A set bit is a white pixel, rows are line_length bytes apart.
+ */
+struct epaper_info {
+    __u32   width;
+    __u32   height;
+    __u32   line_length;
+    __u32   fb_size;        /* mmap length, page aligned */
+};
+
+/* refresh the panel once the window is in controller RAM */
+#define EPAPER_FLUSH_REFRESH            (1 << 0)
+/* upload the whole window even where it matches the last upload */
+#define EPAPER_FLUSH_FORCE              (1 << 1)
+/*
+ * read the window back after the upload and compare crcs, resending it
+ * once on a mismatch; -EIO if it still differs
+ */
+#define EPAPER_FLUSH_VERIFY             (1 << 2)
+
+/*
+ * Window of the shadow framebuffer to push to controller RAM. x and
+ * width are in pixels and widened to byte boundaries. A zero width or
+ * height flushes the whole frame. Unless EPAPER_FLUSH_FORCE is given,
+ * only the parts that differ from what the driver last uploaded are
+ * sent.
+ */
+struct epaper_flush {
+    __u16   x;
+    __u16   y;
+    __u16   width;
+    __u16   height;
+    __u32   flags;
+};
+
+/*
+ * Window of controller RAM to read back, using EPAPER_FLUSH window
+ * rules. Rows of whole bytes are packed into buf; len is the buffer
+ * size on input and the bytes stored on output, crc the crc32 of
+ * those bytes. Needs a readable SDA line (see epaper_selftest).
+ */
+struct epaper_ram_read {
+    __u16   x;
+    __u16   y;
+    __u16   width;
+    __u16   height;
+    __u64   buf;
+    __u32   len;
+    __u32   crc;            /* out */
+};
+
+/* send the async buffer with DC low instead of high */
+#define EPAPER_ASYNC_CMD                (1 << 0)
+
+/*
+ * Queue up to bufsiz bytes for transmission with spi_async(). The call
+ * returns once the buffer is copied into a free ring slot; seq
+ * identifies the submission. poll() reports POLLIN once completions
+ * have not yet been collected with EPAPER_ASYNC_STATUS.
+ */
+struct epaper_async {
+    __u64   buf;
+    __u32   len;
+    __u32   flags;
+    __u64   seq;            /* out */
+};
+
+struct epaper_async_status {
+    __u64   submitted;      /* seq of the last submission */
+    __u64   completed;      /* seq of the last completion */
+    __s32   error;          /* first error since the last query */
+    __u32   pending;        /* submissions not yet completed */
+};
+
+/*
+ * A full 1bpp frame (fb_size rounded down to width x height, that is
+ * line_length * height bytes) copied into one of two driver buffers.
+ * The call returns once the frame is copied, so the next frame can be
+ * rendered while this one is uploaded and refreshed; it only blocks
+ * while both buffers are in flight. flags take EPAPER_FLUSH_*.
+ */
+struct epaper_frame {
+    __u64   buf;
+    __u32   len;
+    __u32   flags;
+    __u64   fence;          /* out */
+};
+
+/*
+ * Wait until the frame or job with this fence has been carried out.
+ * Fails with the error of the job that carried it out, as long as no
+ * later job failed since.
+ */
+struct epaper_fence_wait {
+    __u64   fence;
+    __u32   timeout_ms;
+    __u32   reserved;
+};
+
+/*
+ * Jobs run one at a time on a per-device worker, highest prio first.
+ * A job replaces queued jobs of the same kind that it makes redundant
+ * (an upload whose window covers theirs, any newer refresh or sleep)
+ * and its fence then also stands in for theirs. Uploads read the
+ * mmap'ed framebuffer when they run; rect uses EPAPER_FLUSH semantics.
+ * A sleep job puts the controller into deep sleep; the next upload or
+ * refresh job, or EPAPER_RESET, wakes it with a reset and the
+ * EPAPER_SET_INIT script. At most 64 fences may be pending per device,
+ * EPAPER_QUEUE_JOB and EPAPER_SUBMIT_FRAME fail with EAGAIN beyond
+ * that. write(), read(), EPAPER_SUBMIT_STREAM, EPAPER_ASYNC_SUBMIT,
+ * EPAPER_RESET and the other calls that talk to the panel wait until
+ * no job is pending, but a sequence spanning several such calls may
+ * still have jobs run between them.
+ */
+#define EPAPER_JOB_UPLOAD               0
+#define EPAPER_JOB_REFRESH              1
+#define EPAPER_JOB_SLEEP                2
+
+struct epaper_job_req {
+    __u64   fence;          /* out */
+    __u32   type;
+    __s32   prio;
+    struct epaper_flush rect;
+    __u32   reserved;
+};
+
+/*
+ * RESET is held low for low_ms, then released for high_ms. With
+ * EPAPER_RESET_WAIT_BUSY the driver instead returns as soon as the
+ * controller drops BUSY after the release, high_ms becoming the upper
+ * bound. Both are 1 to 1000 ms, reserved must be 0.
+ */
+#define EPAPER_RESET_WAIT_BUSY          (1 << 0)
+
+struct epaper_reset_timing {
+    __u32   low_ms;
+    __u32   high_ms;
+    __u32   flags;
+    __u32   reserved;
+};
+
+/*
+ * Ramp the SPI clock from min_hz up in step_hz increments, writing a
+ * test pattern into controller RAM and reading it back at every step.
+ * best_hz is the highest clock that verified, 0 if none did. The test
+ * needs the controller's SDA readable (spi-3wire) and overwrites RAM.
+ */
+struct epaper_selftest {
+    __u32   min_hz;
+    __u32   max_hz;
+    __u32   step_hz;
+    __u32   best_hz;        /* out */
+};
 
 #endif // EPAPER_CMDS_H
\ No newline at end of file
@@ -31,19 +31,36 @@
  * ================================================================
  */
 
-#include <sys/ioctl.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include "epaper_core.h"
 #include "epaper_cmds.h"
+#include "epaper_paint.h"
+#include "epaper_transport.h"
+
+/* merge two dirty bands when the rows between them cost fewer bytes */
+#define EPD_RECT_MERGE_BYTES 32
+
+/*
+ * BUSY waits sleep through 7/8 of the learned duration and then poll
+ * every EPD_BUSY_POLL_US. The estimate moves 1/4 towards each sample.
+ */
+#define EPD_BUSY_POLL_US    500
+#define EPD_BUSY_EWMA_SHIFT 2
+/* samples without BUSY before an operation stops being waited on */
+#define EPD_BUSY_LEARN      8
+/* skipped pointer waits before BUSY is checked once more */
+#define EPD_BUSY_RESAMPLE   16
 
 
 static void epd_set_lut(struct epd_s *e, const unsigned char *l)
 {
+    e->lut = l;
     epd_send_cmd(e, WRITE_LUT_REGISTER);
     /* the length of look-up table is 30 bytes */
     for (int i = 0; i < 30; i++)
@@ -71,7 +88,7 @@ static void epd_set_memory_pointer(struct epd_s *e, int x, int y)
     epd_send_cmd(e, SET_RAM_Y_ADDRESS_COUNTER);
     epd_send_data(e, y & 0xFF);
     epd_send_data(e, (y >> 8) & 0xFF);
-    epd_wait_until_idle(e);
+    epd_wait_busy(e, EPD_OP_POINTER);
 }
 
 void epd_delay_ms(unsigned int ms)
@@ -79,22 +96,113 @@ void epd_delay_ms(unsigned int ms)
     usleep(ms * 1000);
 }
 
-struct epd_s *epd_create_epaper(void)
+struct epd_s *epd_alloc(const struct epd_transport_ops *ops)
 {
     struct epd_s *e;
-    e = (struct epd_s *) malloc(sizeof(struct epd_s));
-    if(!e)
-        return NULL;
-    e->fd = open(EPAPER_SPI_DEV_PATH, O_WRONLY);
-    if (e->fd < 0)
+
+    e = (struct epd_s *) calloc(1, sizeof(struct epd_s));
+    if (!e)
         return NULL;
+    e->fd = -1;
     e->width = EPD_WIDTH;
     e->height = EPD_HEIGHT;
+    e->ops = ops;
+    e->full_every = EPD_FULL_REFRESH_EVERY;
     return e;
 }
 
-void epd_init_epaper(struct epd_s *e, const unsigned char *l)
+struct epd_s *epd_create_epaper(void)
+{
+    const char *spec = getenv("EPD_TRANSPORT");
+
+    if (spec && *spec)
+        return epd_create_epaper_spec(spec);
+    return epd_create_epaper_dev(EPAPER_SPI_DEV_PATH);
+}
+
+struct epd_s *epd_create_epaper_spec(const char *spec)
 {
+    char spidev[64], chip[64];
+    unsigned int busy, dc, reset, hz = 2000000;
+
+    if (!strcmp(spec, "chardev"))
+        return epd_create_epaper_dev(EPAPER_SPI_DEV_PATH);
+    if (!strncmp(spec, "chardev:", 8))
+        return epd_create_epaper_dev(spec + 8);
+    if (!strcmp(spec, "sim"))
+        return epd_create_epaper_sim();
+    if (sscanf(spec, "spidev:%63[^,],%63[^,],%u,%u,%u,%u",
+               spidev, chip, &busy, &dc, &reset, &hz) >= 5)
+        return epd_create_epaper_spidev(spidev, chip, busy, dc, reset, hz);
+    errno = EINVAL;
+    return NULL;
+}
+
+static unsigned char *
+epd_seg_put(unsigned char *p, unsigned char op, const unsigned char *data,
+        unsigned short len)
+{
+    struct epaper_seg seg = { .op = op, .len = len };
+
+    memcpy(p, &seg, sizeof(seg));
+    memcpy(p + sizeof(seg), data, len);
+    return p + sizeof(seg) + len;
+}
+
+/* hand the init sequence to the driver, which resets the panel and replays it */
+static int epd_upload_init(struct epd_s *e, const unsigned char *l)
+{
+    const unsigned char driver_output[] = {
+        (EPD_HEIGHT - 1) & 0xFF, ((EPD_HEIGHT - 1) >> 8) & 0xFF, 0x00
+    };
+    const unsigned char booster[] = { 0xD7, 0xD6, 0x9D };
+    const unsigned char vcom = 0xA8, dummy_line = 0x08, entry_mode = 0x03;
+    const struct {
+        unsigned char           cmd;
+        const unsigned char     *data;
+        unsigned short          len;
+    } seq[] = {
+        { DRIVER_OUTPUT_CONTROL,        driver_output,  sizeof(driver_output) },
+        { BOOSTER_SOFT_START_CONTROL,   booster,        sizeof(booster) },
+        { WRITE_VCOM_REGISTER,          &vcom,          1 },
+        { SET_DUMMY_LINE_PERIOD,        &dummy_line,    1 },
+        { DATA_ENTRY_MODE_SETTING,      &entry_mode,    1 },
+        /* the length of look-up table is 30 bytes */
+        { WRITE_LUT_REGISTER,           l,              30 },
+    };
+    unsigned char script[256], *p = script;
+    struct epaper_stream stream;
+
+    for (size_t i = 0; i < sizeof(seq) / sizeof(seq[0]); i++) {
+        p = epd_seg_put(p, EPAPER_SEG_CMD, &seq[i].cmd, 1);
+        p = epd_seg_put(p, EPAPER_SEG_DATA, seq[i].data, seq[i].len);
+    }
+    stream.buf = (unsigned long)script;
+    stream.len = p - script;
+    stream.reserved = 0;
+    if (!e->ops->set_init)
+        return -ENOTTY;
+    epd_flush(e);
+    return e->ops->set_init(e, &stream, sizeof(stream));
+}
+
+int epd_init_epaper(struct epd_s *e, const unsigned char *l)
+{
+    int ret;
+
+    e->partials = 0;
+    e->synced = 0;
+    /* a new init may change what the controller is busy for */
+    memset(e->busy, 0, sizeof(e->busy));
+    ret = epd_upload_init(e, l);
+    if (ret == 0) {
+        e->lut = l;
+        return 0;
+    }
+    /* other errors come from the reset or the panel, not a missing ioctl */
+    if (ret != -ENOTTY && ret != -EINVAL)
+        return ret;
+    /* driver without EPAPER_SET_INIT */
     /* EPD hardware init start */
     epd_reset(e);
     epd_send_cmd(e, DRIVER_OUTPUT_CONTROL);
@@ -113,42 +221,188 @@ void epd_init_epaper(struct epd_s *e, const unsigned char *l)
     epd_send_data(e, 0x03);
     epd_set_lut(e, l);
     /* EPD hardware init end */
+    return epd_flush(e) < 0 ? -EIO : 0;
 }
 
 void epd_release_epaper(struct epd_s *e)
 {
-    close(e->fd);
+    epd_flush(e);
+    e->ops->close(e);
     free(e);
 }
 
+/* send one byte with the DC level of the last run */
 size_t epd_spi_transfer(struct epd_s *e, const char c)
 {
-    return write(e->fd, &c, 1);
+    epd_flush(e);
+    return e->ops->write(e, e->buf_dc, (const unsigned char *)&c, 1) < 0 ? -1 : 1;
 }
 
-int epd_send_data(struct epd_s *e, const char c)
+/* hand the buffered DC run to the transport */
+int epd_flush(struct epd_s *e)
+{
+    int ret;
+
+    if (!e->buf_len)
+        return 0;
+    ret = e->ops->write(e, e->buf_dc, e->buf, e->buf_len);
+    e->buf_len = 0;
+    return ret < 0 ? -1 : 0;
+}
+
+/* queue bytes with the given DC level, flushing when it changes */
+static int epd_queue(struct epd_s *e, int dc, const unsigned char *p, size_t len)
+{
+    size_t n;
+
+    if (e->buf_len && e->buf_dc != dc && epd_flush(e) < 0)
+        return -1;
+    e->buf_dc = dc;
+    while (len) {
+        if (e->buf_len == EPD_CMDBUF_SIZE && epd_flush(e) < 0)
+            return -1;
+        n = EPD_CMDBUF_SIZE - e->buf_len;
+        if (n > len)
+            n = len;
+        memcpy(e->buf + e->buf_len, p, n);
+        e->buf_len += n;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void epd_send_data_run(struct epd_s *e, const unsigned char *p, size_t len)
 {
-    ioctl(e->fd, EPAPER_DC_PIN_SET_HIGH);
-    if (epd_spi_transfer(e, c) < 0)
+    if (epd_queue(e, 1, p, len) < 0)
         exit(-EIO);
+}
+
+int epd_send_data(struct epd_s *e, const char c)
+{
+    epd_send_data_run(e, (const unsigned char *)&c, 1);
     return 0;
 }
 
 int epd_send_cmd(struct epd_s *e, const char c)
 {
-    ioctl(e->fd, EPAPER_DC_PIN_SET_LOW);
-    return epd_spi_transfer(e, c);
+    return epd_queue(e, 0, (const unsigned char *)&c, 1);
 }
 
 int epd_wait_until_idle(struct epd_s *e)
 {
-    while (ioctl(e->fd, EPAPER_IS_DEV_BUSY) == EPD_BUSY)
-        epd_delay_ms(100);  // 100ms
+    return epd_wait_busy(e, EPD_OP_OTHER);
+}
+
+static unsigned long long epd_now_us(struct epd_s *e)
+{
+    struct timespec ts;
+
+    if (e->ops->now_us)
+        return e->ops->now_us(e);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static void epd_delay_us(struct epd_s *e, unsigned long us)
+{
+    if (e->ops->delay_us)
+        e->ops->delay_us(e, us);
+    else
+        usleep(us);
+}
+
+static void epd_busy_record(struct epd_busy_stat *b, unsigned long us)
+{
+    if (!b->samples)
+        b->ewma_us = us;
+    else if (us > b->ewma_us)
+        b->ewma_us += (us - b->ewma_us) >> EPD_BUSY_EWMA_SHIFT;
+    else
+        /* round down so the estimate can settle at 0 */
+        b->ewma_us -= (b->ewma_us - us + (1 << EPD_BUSY_EWMA_SHIFT) - 1) >>
+                      EPD_BUSY_EWMA_SHIFT;
+    if (b->samples < EPD_BUSY_LEARN)
+        b->samples++;
+}
+
+/*
+ * Sleep until shortly before the operation is expected to finish, then
+ * poll finely up to the deadline. Until the first sample is in, the
+ * transport's own wait_idle is used.
+ */
+int epd_wait_busy(struct epd_s *e, int op)
+{
+    struct epd_busy_stat *b = &e->busy[op];
+    unsigned long long start, deadline;
+    unsigned long guess;
+    int ret;
+
+    /*
+     * Window setup never raised BUSY so far, keep the run batched. Check
+     * again now and then in case the controller has started to.
+     */
+    if (op == EPD_OP_POINTER && b->samples >= EPD_BUSY_LEARN && !b->ewma_us &&
+        ++b->skipped < EPD_BUSY_RESAMPLE)
+        return 0;
+    b->skipped = 0;
+    if (epd_flush(e) < 0)
+        return -EIO;
+    start = epd_now_us(e);
+    deadline = start + EPD_BUSY_TIMEOUT_MS * 1000ULL;
+    ret = e->ops->is_busy(e);
+    if (ret <= 0) {
+        if (ret == 0)
+            epd_busy_record(b, 0);
+        return ret;
+    }
+    if (!b->samples) {
+        ret = e->ops->wait_idle(e, EPD_BUSY_TIMEOUT_MS);
+        if (ret == 0)
+            epd_busy_record(b, epd_now_us(e) - start);
+        return ret;
+    }
+    guess = b->ewma_us - (b->ewma_us >> 3);
+    if (guess > EPD_BUSY_POLL_US)
+        epd_delay_us(e, guess);
+    while ((ret = e->ops->is_busy(e)) > 0) {
+        if (epd_now_us(e) >= deadline)
+            return -ETIMEDOUT;
+        epd_delay_us(e, EPD_BUSY_POLL_US);
+    }
+    if (ret < 0)
+        return ret;
+    epd_busy_record(b, epd_now_us(e) - start);
+    return 0;
 }
 
 void epd_reset(struct epd_s *e)
 {
-    ioctl(e->fd, EPAPER_RESET);
+    epd_flush(e);
+    e->ops->reset(e);
+    /* the controller is busy again after reset, relearn the cheap waits */
+    e->busy[EPD_OP_POINTER].samples = 0;
+    /* RAM and LUT are gone unless the driver replays an init script */
+    e->lut = NULL;
+    e->synced = 0;
+}
+
+/*
+ * Let the transport place a window itself where it can do better than
+ * a WRITE_RAM run, i.e. the kernel driver diffing against what it last
+ * uploaded. Non-zero means the caller sends it as commands.
+ */
+static int epd_upload_window(struct epd_s *e, const unsigned char *buf,
+        int stride, int x, int y, int width, int height)
+{
+    struct epd_rect r = { x, y, width, height };
+
+    if (!e->ops->upload || width <= 0 || height <= 0)
+        return -ENOTTY;
+    /* queued commands go out before the window */
+    if (epd_flush(e) < 0)
+        return -EIO;
+    return e->ops->upload(e, buf, stride, &r);
 }
 
 void epd_set_frame_memory(struct epd_s *e,
@@ -175,36 +429,151 @@ void epd_set_frame_memory(struct epd_s *e,
     } else {
         y_end = y + image_height - 1;
     }
+    if (epd_upload_window(e, image_buffer, image_width / 8,
+                          x, y, x_end - x + 1, y_end - y + 1) == 0)
+        return;
     epd_set_memory_area(e, x, y, x_end, y_end);
     epd_set_memory_pointer(e, x, y);
     epd_send_cmd(e, WRITE_RAM);
     /* send the image data */
     for (int j = 0; j < y_end - y + 1; j++)
-        for (int i = 0; i < (x_end - x + 1) / 8; i++)
-            epd_send_data(e, image_buffer[i + j * (image_width / 8)]);
+        epd_send_data_run(e, image_buffer + j * (image_width / 8),
+                          (x_end - x + 1) / 8);
 }
 
 void epd_clear_frame_memory(struct epd_s *e, unsigned char color)
 {
+    unsigned char row[EPD_WIDTH / 8];
+
+    memset(row, color, sizeof(row));
+    /* a stride of 0 repeats the row */
+    if (epd_upload_window(e, row, 0, 0, 0, e->width, e->height) == 0)
+        return;
     epd_set_memory_area(e, 0, 0, e->width - 1, e->height - 1);
     epd_set_memory_pointer(e, 0, 0);
     epd_send_cmd(e, WRITE_RAM);
     /* send the color data */
-    for (int i = 0; i < e->width / 8 * e->height; i++)
-        epd_send_data(e, color);
+    for (int j = 0; j < e->height; j++)
+        epd_send_data_run(e, row, e->width / 8);
+}
+
+/* upload one window of a frame whose rows are stride bytes apart */
+static void epd_upload_rect(struct epd_s *e, const unsigned char *frame,
+        int stride, const struct epd_rect *r)
+{
+    epd_set_memory_area(e, r->x, r->y, r->x + r->width - 1, r->y + r->height - 1);
+    epd_set_memory_pointer(e, r->x, r->y);
+    epd_send_cmd(e, WRITE_RAM);
+    for (int j = r->y; j < r->y + r->height; j++)
+        epd_send_data_run(e, frame + j * stride + r->x / 8, r->width / 8);
+}
+
+int epd_dirty_rects(const unsigned char *prev, const unsigned char *next,
+        int width, int height, struct epd_rect *rects, int max)
+{
+    int stride = width / 8, n = 0, gap = 0;
+    int lo, hi;
+    struct epd_rect *r = NULL;
+
+    for (int y = 0; y < height; y++) {
+        const unsigned char *a = prev + y * stride, *b = next + y * stride;
+
+        for (lo = 0; lo < stride && a[lo] == b[lo]; lo++)
+            ;
+        if (lo == stride) {
+            gap++;
+            continue;
+        }
+        for (hi = stride - 1; a[hi] == b[hi]; hi--)
+            ;
+        /* start a new band unless the clean rows are cheaper to resend */
+        if (!r || (gap * stride > EPD_RECT_MERGE_BYTES && n < max)) {
+            r = &rects[n++];
+            r->x = lo * 8;
+            r->y = y;
+            r->width = (hi - lo + 1) * 8;
+        } else {
+            if (lo * 8 < r->x) {
+                r->width += r->x - lo * 8;
+                r->x = lo * 8;
+            }
+            if ((hi + 1) * 8 > r->x + r->width)
+                r->width = (hi + 1) * 8 - r->x;
+        }
+        r->height = y - r->y + 1;
+        gap = 0;
+    }
+    return n;
 }
 
-void epd_display_frame(struct epd_s *e)
+void epd_set_full_refresh_interval(struct epd_s *e, int n)
+{
+    e->full_every = n < 0 ? 0 : n;
+}
+
+/*
+ * The controller flips between two RAM banks on every refresh, so each
+ * window goes in before the refresh and again after it, leaving both
+ * banks equal to next for the diff of the following update.
+ */
+int epd_update_frame(struct epd_s *e,
+        const struct epd_paint *prev, const struct epd_paint *next)
+{
+    struct epd_rect rects[EPD_MAX_DIRTY_RECTS];
+    struct epd_rect full = { 0, 0, e->width, e->height };
+    int stride = next->width / 8;
+    int n, ret;
+
+    /* epd_dirty_rects() walks both frames with the panel's stride */
+    if (next->width != e->width || next->height != e->height)
+        return -EINVAL;
+    if (!prev || !e->synced ||
+        prev->width != next->width || prev->height != next->height ||
+        (e->full_every && e->partials >= e->full_every)) {
+        if (e->lut != lut_full_update)
+            epd_set_lut(e, lut_full_update);
+        memcpy(rects, &full, sizeof(full));
+        n = 1;
+        e->partials = 0;
+    } else {
+        n = epd_dirty_rects(prev->frame_buffer, next->frame_buffer,
+                            e->width, e->height, rects, EPD_MAX_DIRTY_RECTS);
+        if (!n)
+            return 0;
+        if (e->lut != lut_partial_update)
+            epd_set_lut(e, lut_partial_update);
+        e->partials++;
+    }
+    /* until both banks are written again they no longer match */
+    e->synced = 0;
+    for (int i = 0; i < n; i++)
+        epd_upload_rect(e, next->frame_buffer, stride, &rects[i]);
+    ret = epd_display_frame(e);
+    if (ret < 0)
+        return ret;
+    for (int i = 0; i < n; i++)
+        epd_upload_rect(e, next->frame_buffer, stride, &rects[i]);
+    ret = epd_flush(e);
+    if (ret < 0)
+        return -EIO;
+    e->synced = 1;
+    return n;
+}
+
+int epd_display_frame(struct epd_s *e)
 {
     epd_send_cmd(e, DISPLAY_UPDATE_CONTROL_2);
     epd_send_data(e, 0xC4);
     epd_send_cmd(e, MASTER_ACTIVATION);
     epd_send_cmd(e, TERMINATE_FRAME_READ_WRITE);
-    epd_wait_until_idle(e);
+    return epd_wait_busy(e, e->lut == lut_partial_update ?
+                            EPD_OP_PARTIAL : EPD_OP_FULL);
 }
 
 void epd_epaper_sleep(struct epd_s *e)
 {
+    /* waking up takes a reset, which loses RAM */
+    e->synced = 0;
     epd_send_cmd(e, DEEP_SLEEP_MODE);
     epd_wait_until_idle(e);
 }
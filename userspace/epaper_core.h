@@ -56,28 +56,98 @@
 #define EPD_WIDTH       200
 #define EPD_HEIGHT      200
 
-#define EPAPER_SPI_DEV_PATH "/dev/epaper_spi_dev"
+#define EPAPER_SPI_DEV_PATH "/dev/epaper_spi_dev0"
 
 #define EPD_BUSY 1
 #define EPD_IDLE 0
 
+#define EPD_BUSY_TIMEOUT_MS 10000
+
+/* operations whose BUSY time is learned separately */
+#define EPD_OP_FULL     0
+#define EPD_OP_PARTIAL  1
+#define EPD_OP_POINTER  2
+#define EPD_OP_OTHER    3
+#define EPD_OP_NR       4
+
+/* bytes of one DC run collected before they are written out */
+#define EPD_CMDBUF_SIZE 4096
+
+/* partial refreshes before epd_update_frame() forces a full one */
+#define EPD_FULL_REFRESH_EVERY 10
+#define EPD_MAX_DIRTY_RECTS 8
+
+struct epd_transport_ops;
+struct epd_paint;
+
+/* area of the frame, x and width are multiples of 8 */
+struct epd_rect {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+/* running estimate of how long BUSY stays high after an operation */
+struct epd_busy_stat {
+    unsigned long ewma_us;
+    unsigned int samples;
+    unsigned int skipped;   /* pointer waits skipped since the last check */
+};
+
 struct epd_s {
-    int fd;
+    int fd;         /* device node of the transport, -1 if it has none */
     int width;
     int height;
+    int dc_prefix;  /* driver takes DC from the first byte of a write */
+    const struct epd_transport_ops *ops;
+    void *priv;     /* transport state */
+    const unsigned char *lut;   /* LUT currently loaded */
+    int partials;   /* partial refreshes since the last full one */
+    int synced;     /* both RAM banks hold the frame shown, see epd_update_frame() */
+    int full_every;
+    struct epd_busy_stat busy[EPD_OP_NR];
+    int buf_dc;
+    size_t buf_len;
+    unsigned char buf[EPD_CMDBUF_SIZE];
 };
 
 extern const unsigned char lut_full_update[];
 extern const unsigned char lut_partial_update[];
 
+/* the transport named by $EPD_TRANSPORT, else the default chardev */
 struct epd_s *epd_create_epaper(void);
+/* open a specific panel, e.g. "/dev/epaper_spi_dev1" */
+struct epd_s *epd_create_epaper_dev(const char *path);
+/* stock spidev plus gpiochip line offsets, no kernel module needed */
+struct epd_s *epd_create_epaper_spidev(const char *spidev, const char *gpiochip,
+        unsigned int busy, unsigned int dc, unsigned int reset,
+        unsigned int speed_hz);
+/* in-process model of the controller, no hardware needed */
+struct epd_s *epd_create_epaper_sim(void);
+/* write what a simulated panel shows as a PBM image */
+int epd_sim_save_pbm(struct epd_s *e, const char *path);
+/*
+ * "chardev[:path]", "spidev:spidev,gpiochip,busy,dc,reset[,hz]" or
+ * "sim"
+ */
+struct epd_s *epd_create_epaper_spec(const char *spec);
 void epd_release_epaper(struct epd_s *e);
 void epd_delay_ms(unsigned int ms);
-void epd_init_epaper(struct epd_s *e, const unsigned char *l);
+/*
+ * Hardware reset, then geometry and LUT l. Drivers with EPAPER_SET_INIT
+ * keep the sequence and replay it on every later reset. Only call it
+ * for a cold start, epd_update_frame() switches LUTs without a reset.
+ * 0 or a negative errno.
+ */
+int epd_init_epaper(struct epd_s *e, const unsigned char *l);
 size_t epd_spi_transfer(struct epd_s *e, const char c);
 int epd_send_data(struct epd_s *e, const char c);
 int epd_send_cmd(struct epd_s *e, const char c);
+int epd_flush(struct epd_s *e);
 int epd_wait_until_idle(struct epd_s *e);
+/* wait for BUSY after op, 0 or -ETIMEDOUT after EPD_BUSY_TIMEOUT_MS */
+int epd_wait_busy(struct epd_s *e, int op);
 void epd_reset(struct epd_s *e);
 void epd_set_frame_memory(
     struct epd_s *e,
@@ -88,7 +158,21 @@ void epd_set_frame_memory(
     int image_height
 );
 void epd_clear_frame_memory(struct epd_s *e, unsigned char color);
-void epd_display_frame(struct epd_s *e);
+int epd_display_frame(struct epd_s *e);
+/* changed areas between two frames of width x height pixels */
+int epd_dirty_rects(const unsigned char *prev, const unsigned char *next,
+        int width, int height, struct epd_rect *rects, int max);
+/*
+ * Show next with a partial refresh of what differs from prev, or with
+ * a full refresh when prev is NULL or the interval is reached. Partial
+ * refreshes rely on both RAM banks still holding prev, so the first
+ * update after init, a reset or sleep is always a full one. next must
+ * be exactly the size of the panel.
+ */
+int epd_update_frame(struct epd_s *e,
+        const struct epd_paint *prev, const struct epd_paint *next);
+/* full refresh every n updates, 0 never forces one */
+void epd_set_full_refresh_interval(struct epd_s *e, int n);
 void epd_epaper_sleep(struct epd_s *e);
 
 #endif // EPAPER_CORE_H
@@ -0,0 +1,421 @@
+/**
+ *  Copyright (C) Waveshare     July 28 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documnetation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to  whom the Software is
+ * furished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS OR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/**
+ * Rewritten to apply to C language
+ * SHOOTERX1 <yorha.a2@foxmail.com>
+ */
+/**
+ * ================================================================
+ * epaper_sim.c         ----  transport file
+ * in-process model of an SSD1608-class controller, lets the library
+ * run and be benchmarked on any Linux box.
+ *
+ * The model decodes every byte the core sends: RAM, the X/Y address
+ * window and counters, DATA_ENTRY_MODE_SETTING, the LUT and deep
+ * sleep. Time is virtual: each write costs its bits at the SPI clock
+ * and BUSY is held for the modelled reset and refresh times, so a run
+ * finishes at CPU speed but reports what the wire would have taken.
+ * The core's BUSY sleeps run on the same virtual clock.
+ *
+ * Environment:
+ *   EPD_SIM_HZ     SPI clock to account for, default 2000000
+ *   EPD_SIM_PBM    write the panel image to this file on release
+ *   EPD_SIM_STATS  print the counters to stderr on release
+ * ================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "epaper_core.h"
+#include "epaper_transport.h"
+
+#define SIM_DEFAULT_HZ      2000000
+/* reset pulse the drivers use, and the BUSY time after it */
+#define SIM_RESET_US        400000
+#define SIM_RESET_BUSY_US   2000
+/* one gate line at the default SET_GATE_TIME */
+#define SIM_LINE_US         50
+/* frames of a refresh when no LUT was loaded */
+#define SIM_DEFAULT_FRAMES  80
+#define SIM_LUT_SIZE        30
+/* the last ten LUT bytes hold the phase lengths, two per byte */
+#define SIM_LUT_TP          20
+
+struct sim_stats {
+    unsigned long writes;
+    unsigned long cmd_bytes;
+    unsigned long data_bytes;
+    unsigned long ram_bytes;
+    unsigned long resets;
+    unsigned long refreshes;
+    unsigned long busy_writes;      /* bytes sent while BUSY was high */
+    unsigned long sleep_writes;     /* bytes dropped in deep sleep */
+    unsigned long long wire_us;
+    unsigned long long busy_us;
+    unsigned long long reset_us;
+};
+
+struct sim_priv {
+    unsigned int speed_hz;
+    unsigned long long now_us;      /* virtual clock */
+    unsigned long long busy_until;
+
+    int line_length;                /* bytes per RAM row */
+    int rows;
+    unsigned char *ram;
+    unsigned char *panel;           /* what the last refresh showed */
+
+    unsigned char cmd;
+    int nargs;
+    unsigned char args[4];
+    int xs, xe, ys, ye;
+    int x, y;
+    unsigned char entry;
+    unsigned char update_ctrl;
+    unsigned char lut[SIM_LUT_SIZE];
+    int lut_len;
+    int gate_lines;
+    int dummy_lines;
+    int sleeping;
+
+    struct sim_stats stats;
+};
+
+static void sim_hold_busy(struct sim_priv *s, unsigned long long us)
+{
+    s->busy_until = s->now_us + us;
+    s->stats.busy_us += us;
+}
+
+/* a refresh walks every LUT phase, one frame per gate scan */
+static unsigned long long sim_refresh_us(struct sim_priv *s)
+{
+    unsigned long frames = 0;
+
+    if (s->lut_len < SIM_LUT_SIZE) {
+        frames = SIM_DEFAULT_FRAMES;
+    } else {
+        for (int i = SIM_LUT_TP; i < SIM_LUT_SIZE; i++)
+            frames += (s->lut[i] & 0x0F) + (s->lut[i] >> 4);
+    }
+    return (unsigned long long)frames *
+           (s->gate_lines + s->dummy_lines) * SIM_LINE_US;
+}
+
+static void sim_hw_reset(struct sim_priv *s)
+{
+    s->cmd = 0;
+    s->nargs = 0;
+    s->xs = s->ys = s->x = s->y = 0;
+    s->xe = s->line_length - 1;
+    s->ye = s->rows - 1;
+    s->entry = 0x03;
+    s->update_ctrl = 0;
+    s->lut_len = 0;
+    s->gate_lines = s->rows;
+    s->dummy_lines = 0;
+    s->sleeping = 0;
+}
+
+/* step the address counter along the data entry mode */
+static void sim_advance(struct sim_priv *s)
+{
+    int xinc = s->entry & 0x01, yinc = s->entry & 0x02;
+    int ydir = s->entry & 0x04;
+    int xlo = s->xs < s->xe ? s->xs : s->xe, xhi = s->xs < s->xe ? s->xe : s->xs;
+    int ylo = s->ys < s->ye ? s->ys : s->ye, yhi = s->ys < s->ye ? s->ye : s->ys;
+    int wrap;
+
+    if (!ydir) {
+        wrap = xinc ? s->x >= xhi : s->x <= xlo;
+        s->x = wrap ? (xinc ? xlo : xhi) : (xinc ? s->x + 1 : s->x - 1);
+        if (!wrap)
+            return;
+        s->y = yinc ? (s->y >= yhi ? ylo : s->y + 1) :
+                      (s->y <= ylo ? yhi : s->y - 1);
+    } else {
+        wrap = yinc ? s->y >= yhi : s->y <= ylo;
+        s->y = wrap ? (yinc ? ylo : yhi) : (yinc ? s->y + 1 : s->y - 1);
+        if (!wrap)
+            return;
+        s->x = xinc ? (s->x >= xhi ? xlo : s->x + 1) :
+                      (s->x <= xlo ? xhi : s->x - 1);
+    }
+}
+
+static void sim_cmd(struct sim_priv *s, unsigned char cmd)
+{
+    s->cmd = cmd;
+    s->nargs = 0;
+    switch (cmd) {
+        case SW_RESET:
+            sim_hw_reset(s);
+            sim_hold_busy(s, SIM_RESET_BUSY_US);
+            break;
+        case DEEP_SLEEP_MODE:
+            /* the driver sends no argument, the command alone sleeps */
+            s->sleeping = 1;
+            break;
+        case MASTER_ACTIVATION:
+            /* 0x04 in DISPLAY_UPDATE_CONTROL_2 runs the display pattern */
+            if (s->update_ctrl & 0x04) {
+                memcpy(s->panel, s->ram, s->line_length * s->rows);
+                s->stats.refreshes++;
+                sim_hold_busy(s, sim_refresh_us(s));
+            }
+            break;
+    }
+}
+
+static void sim_data(struct sim_priv *s, unsigned char byte)
+{
+    if (s->nargs < (int)sizeof(s->args))
+        s->args[s->nargs] = byte;
+    s->nargs++;
+
+    switch (s->cmd) {
+        case DRIVER_OUTPUT_CONTROL:
+            if (s->nargs == 2)
+                s->gate_lines = (s->args[0] | (s->args[1] << 8)) + 1;
+            break;
+        case DEEP_SLEEP_MODE:
+            s->sleeping = byte & 0x01;
+            break;
+        case DATA_ENTRY_MODE_SETTING:
+            s->entry = byte & 0x07;
+            break;
+        case DISPLAY_UPDATE_CONTROL_2:
+            s->update_ctrl = byte;
+            break;
+        case WRITE_RAM:
+            if (s->x < s->line_length && s->y < s->rows)
+                s->ram[s->y * s->line_length + s->x] = byte;
+            s->stats.ram_bytes++;
+            sim_advance(s);
+            break;
+        case WRITE_LUT_REGISTER:
+            if (s->nargs <= SIM_LUT_SIZE) {
+                s->lut[s->nargs - 1] = byte;
+                s->lut_len = s->nargs;
+            }
+            break;
+        case SET_DUMMY_LINE_PERIOD:
+            s->dummy_lines = byte & 0x7F;
+            break;
+        case SET_RAM_X_ADDRESS_START_END_POSITION:
+            if (s->nargs == 2) {
+                s->xs = s->args[0];
+                s->xe = s->args[1];
+            }
+            break;
+        case SET_RAM_Y_ADDRESS_START_END_POSITION:
+            if (s->nargs == 4) {
+                s->ys = s->args[0] | (s->args[1] << 8);
+                s->ye = s->args[2] | (s->args[3] << 8);
+            }
+            break;
+        case SET_RAM_X_ADDRESS_COUNTER:
+            s->x = byte;
+            break;
+        case SET_RAM_Y_ADDRESS_COUNTER:
+            if (s->nargs == 2)
+                s->y = s->args[0] | (s->args[1] << 8);
+            break;
+    }
+}
+
+static int sim_write(struct epd_s *e, int dc, const unsigned char *buf, size_t len)
+{
+    struct sim_priv *s = e->priv;
+    unsigned long long us;
+
+    s->stats.writes++;
+    if (dc)
+        s->stats.data_bytes += len;
+    else
+        s->stats.cmd_bytes += len;
+    if (s->now_us < s->busy_until)
+        s->stats.busy_writes += len;
+    for (size_t i = 0; i < len; i++) {
+        /* only a reset wakes the controller from deep sleep */
+        if (s->sleeping && !(dc && s->cmd == DEEP_SLEEP_MODE)) {
+            s->stats.sleep_writes++;
+            continue;
+        }
+        if (dc)
+            sim_data(s, buf[i]);
+        else
+            sim_cmd(s, buf[i]);
+    }
+    us = (unsigned long long)len * 8 * 1000000 / s->speed_hz;
+    s->stats.wire_us += us;
+    s->now_us += us;
+    return 0;
+}
+
+static int sim_reset(struct epd_s *e)
+{
+    struct sim_priv *s = e->priv;
+
+    sim_hw_reset(s);
+    s->stats.resets++;
+    s->stats.reset_us += SIM_RESET_US;
+    s->now_us += SIM_RESET_US;
+    sim_hold_busy(s, SIM_RESET_BUSY_US);
+    return 0;
+}
+
+static int sim_is_busy(struct epd_s *e)
+{
+    struct sim_priv *s = e->priv;
+
+    return s->now_us < s->busy_until;
+}
+
+/* jump the virtual clock to the end of BUSY */
+static int sim_wait_idle(struct epd_s *e, unsigned int timeout_ms)
+{
+    struct sim_priv *s = e->priv;
+    unsigned long long limit = s->now_us + timeout_ms * 1000ULL;
+
+    if (s->now_us >= s->busy_until)
+        return 0;
+    if (s->busy_until > limit) {
+        s->now_us = limit;
+        return -ETIMEDOUT;
+    }
+    s->now_us = s->busy_until;
+    return 0;
+}
+
+static unsigned long long sim_now_us(struct epd_s *e)
+{
+    struct sim_priv *s = e->priv;
+
+    return s->now_us;
+}
+
+static void sim_delay_us(struct epd_s *e, unsigned long us)
+{
+    struct sim_priv *s = e->priv;
+
+    s->now_us += us;
+}
+
+/* dump the panel as a PBM, a set RAM bit is a white pixel */
+int epd_sim_save_pbm(struct epd_s *e, const char *path)
+{
+    struct sim_priv *s = e->priv;
+    FILE *f;
+    int ret = 0;
+
+    if (e->ops->write != sim_write)
+        return -EINVAL;
+    f = fopen(path, "wb");
+    if (!f)
+        return -errno;
+    fprintf(f, "P4\n%d %d\n", s->line_length * 8, s->rows);
+    for (int i = 0; i < s->line_length * s->rows; i++)
+        if (fputc(~s->panel[i] & 0xFF, f) == EOF)
+            ret = -EIO;
+    if (fclose(f))
+        ret = -errno;
+    return ret;
+}
+
+static void sim_print_stats(struct sim_priv *s)
+{
+    fprintf(stderr,
+            "epd sim: %lu writes, %lu cmd, %lu data, %lu ram bytes\n"
+            "epd sim: %lu resets, %lu refreshes, %lu busy writes, %lu sleep writes\n"
+            "epd sim: %llu us total, %llu wire, %llu busy, %llu reset\n",
+            s->stats.writes, s->stats.cmd_bytes, s->stats.data_bytes,
+            s->stats.ram_bytes, s->stats.resets, s->stats.refreshes,
+            s->stats.busy_writes, s->stats.sleep_writes,
+            s->now_us, s->stats.wire_us, s->stats.busy_us,
+            s->stats.reset_us);
+}
+
+static void sim_close(struct epd_s *e)
+{
+    struct sim_priv *s = e->priv;
+    const char *path = getenv("EPD_SIM_PBM");
+
+    if (path && *path && epd_sim_save_pbm(e, path))
+        fprintf(stderr, "epd sim: cannot write %s\n", path);
+    if (getenv("EPD_SIM_STATS"))
+        sim_print_stats(s);
+    free(s->ram);
+    free(s->panel);
+    free(s);
+}
+
+static const struct epd_transport_ops sim_ops = {
+    .name      = "sim",
+    .write     = sim_write,
+    .reset     = sim_reset,
+    .is_busy   = sim_is_busy,
+    .wait_idle = sim_wait_idle,
+    .now_us    = sim_now_us,
+    .delay_us  = sim_delay_us,
+    .close     = sim_close,
+};
+
+struct epd_s *epd_create_epaper_sim(void)
+{
+    struct sim_priv *s;
+    struct epd_s *e;
+    const char *hz = getenv("EPD_SIM_HZ");
+
+    e = epd_alloc(&sim_ops);
+    s = calloc(1, sizeof(*s));
+    if (!e || !s)
+        goto err;
+    s->speed_hz = hz ? strtoul(hz, NULL, 0) : 0;
+    if (!s->speed_hz)
+        s->speed_hz = SIM_DEFAULT_HZ;
+    s->line_length = e->width / 8;
+    s->rows = e->height;
+    /* RAM powers up random on the real part, start it white */
+    s->ram = malloc(s->line_length * s->rows);
+    s->panel = malloc(s->line_length * s->rows);
+    if (!s->ram || !s->panel)
+        goto err;
+    memset(s->ram, 0xFF, s->line_length * s->rows);
+    memset(s->panel, 0xFF, s->line_length * s->rows);
+    sim_hw_reset(s);
+    e->priv = s;
+    return e;
+
+err:
+    if (s) {
+        free(s->ram);
+        free(s->panel);
+    }
+    free(s);
+    free(e);
+    return NULL;
+}
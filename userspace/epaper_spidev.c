@@ -0,0 +1,246 @@
+/**
+ *  Copyright (C) Waveshare     July 28 2017
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documnetation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to  whom the Software is
+ * furished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS OR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/**
+ * Rewritten to apply to C language
+ * SHOOTERX1 <yorha.a2@foxmail.com>
+ */
+/**
+ * ================================================================
+ * epaper_spidev.c      ----  transport file
+ * drives the panel through the stock spidev node and gpiochip
+ * character device (GPIO v2 uAPI), no epaper_spi module needed.
+ * ================================================================
+ */
+
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include <linux/spi/spidev.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+
+#include "epaper_core.h"
+#include "epaper_transport.h"
+
+/* spidev refuses messages larger than its bufsiz parameter */
+#define SPIDEV_CHUNK 4096
+/* same defaults as the kernel driver */
+#define SPIDEV_RESET_LOW_MS 200
+#define SPIDEV_RESET_HIGH_MS 200
+
+struct spidev_priv {
+    int out_fd;         /* line request for DC (bit 0) and RESET (bit 1) */
+    int busy_fd;        /* line request for BUSY with falling edge events */
+    unsigned int speed_hz;
+};
+
+static int spidev_set_lines(struct spidev_priv *p, __u64 mask, __u64 bits)
+{
+    struct gpio_v2_line_values v = { .bits = bits, .mask = mask };
+
+    return ioctl(p->out_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &v) < 0 ? -errno : 0;
+}
+
+static int spidev_write(struct epd_s *e, int dc, const unsigned char *buf, size_t len)
+{
+    struct spidev_priv *p = e->priv;
+    struct spi_ioc_transfer xfer;
+    size_t n;
+    int ret;
+
+    ret = spidev_set_lines(p, 1, dc ? 1 : 0);
+    if (ret)
+        return ret;
+    while (len) {
+        n = len < SPIDEV_CHUNK ? len : SPIDEV_CHUNK;
+        memset(&xfer, 0, sizeof(xfer));
+        xfer.tx_buf = (unsigned long)buf;
+        xfer.len = n;
+        xfer.speed_hz = p->speed_hz;
+        xfer.bits_per_word = 8;
+        if (ioctl(e->fd, SPI_IOC_MESSAGE(1), &xfer) < 0)
+            return -errno;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int spidev_reset(struct epd_s *e)
+{
+    struct spidev_priv *p = e->priv;
+    int ret;
+
+    ret = spidev_set_lines(p, 2, 0);
+    if (ret)
+        return ret;
+    epd_delay_ms(SPIDEV_RESET_LOW_MS);
+    ret = spidev_set_lines(p, 2, 2);
+    epd_delay_ms(SPIDEV_RESET_HIGH_MS);
+    return ret;
+}
+
+static int spidev_is_busy(struct epd_s *e)
+{
+    struct spidev_priv *p = e->priv;
+    struct gpio_v2_line_values v = { .mask = 1 };
+
+    if (ioctl(p->busy_fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &v) < 0)
+        return -errno;
+    return (v.bits & 1) == EPD_BUSY;
+}
+
+static long long spidev_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Sleep on the falling edge of BUSY instead of polling its level. Edges
+ * that leave BUSY high only re-arm poll() for what is left of timeout_ms.
+ */
+static int spidev_wait_idle(struct epd_s *e, unsigned int timeout_ms)
+{
+    struct spidev_priv *p = e->priv;
+    struct gpio_v2_line_event ev;
+    struct pollfd pfd = { .fd = p->busy_fd, .events = POLLIN };
+    long long deadline = spidev_now_ms() + timeout_ms;
+    long long left;
+    int ret;
+
+    for (;;) {
+        ret = spidev_is_busy(e);
+        if (ret <= 0)
+            return ret;
+        left = deadline - spidev_now_ms();
+        if (left <= 0)
+            return -ETIMEDOUT;
+        ret = poll(&pfd, 1, left);
+        if (ret < 0)
+            return -errno;
+        if (ret == 0)
+            return -ETIMEDOUT;
+        /* drain the event, the level is checked again above */
+        if (read(p->busy_fd, &ev, sizeof(ev)) < 0)
+            return -errno;
+    }
+}
+
+static void spidev_close(struct epd_s *e)
+{
+    struct spidev_priv *p = e->priv;
+
+    close(p->busy_fd);
+    close(p->out_fd);
+    close(e->fd);
+    free(p);
+}
+
+static const struct epd_transport_ops spidev_ops = {
+    .name      = "spidev",
+    .write     = spidev_write,
+    .reset     = spidev_reset,
+    .is_busy   = spidev_is_busy,
+    .wait_idle = spidev_wait_idle,
+    .close     = spidev_close,
+};
+
+static int spidev_request_lines(int chip, struct spidev_priv *p,
+        unsigned int busy, unsigned int dc, unsigned int reset)
+{
+    struct gpio_v2_line_request req;
+
+    memset(&req, 0, sizeof(req));
+    strcpy(req.consumer, "epd");
+    req.offsets[0] = dc;
+    req.offsets[1] = reset;
+    req.num_lines = 2;
+    req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    /* start with DC low and RESET released */
+    req.config.num_attrs = 1;
+    req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+    req.config.attrs[0].attr.values = 2;
+    req.config.attrs[0].mask = 3;
+    if (ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &req) < 0)
+        return -errno;
+    p->out_fd = req.fd;
+
+    memset(&req, 0, sizeof(req));
+    strcpy(req.consumer, "epd-busy");
+    req.offsets[0] = busy;
+    req.num_lines = 1;
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    if (ioctl(chip, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+        close(p->out_fd);
+        return -errno;
+    }
+    p->busy_fd = req.fd;
+    return 0;
+}
+
+struct epd_s *epd_create_epaper_spidev(const char *spidev, const char *gpiochip,
+        unsigned int busy, unsigned int dc, unsigned int reset,
+        unsigned int speed_hz)
+{
+    struct spidev_priv *p;
+    struct epd_s *e;
+    unsigned char mode = SPI_MODE_0;
+    int chip;
+
+    e = epd_alloc(&spidev_ops);
+    p = calloc(1, sizeof(*p));
+    if (!e || !p)
+        goto err_free;
+    p->speed_hz = speed_hz;
+    e->priv = p;
+    e->fd = open(spidev, O_RDWR);
+    if (e->fd < 0)
+        goto err_free;
+    if (ioctl(e->fd, SPI_IOC_WR_MODE, &mode) < 0 ||
+        ioctl(e->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed_hz) < 0)
+        goto err_close;
+    chip = open(gpiochip, O_RDWR);
+    if (chip < 0)
+        goto err_close;
+    /* the line fds stay valid after the chip fd is closed */
+    if (spidev_request_lines(chip, p, busy, dc, reset)) {
+        close(chip);
+        goto err_close;
+    }
+    close(chip);
+    return e;
+
+err_close:
+    close(e->fd);
+err_free:
+    free(p);
+    free(e);
+    return NULL;
+}
@@ -0,0 +1,38 @@
+/**
+ * ================================================================
+ * epaper_transport.h   ----  backend interface for struct epd_s
+ * A transport moves DC runs to the panel and drives RESET/BUSY.
+ * ================================================================
+ */
+#if !defined(EPAPER_TRANSPORT_H)
+#define EPAPER_TRANSPORT_H
+
+#include <stddef.h>
+
+#include "epaper_core.h"
+
+struct epd_transport_ops {
+    const char *name;
+    /* send one run of bytes, dc is 0 for commands and 1 for data */
+    int  (*write)(struct epd_s *e, int dc, const unsigned char *buf, size_t len);
+    int  (*reset)(struct epd_s *e);
+    int  (*is_busy)(struct epd_s *e);
+    int  (*wait_idle)(struct epd_s *e, unsigned int timeout_ms);
+    /* optional, replay an EPAPER_SET_INIT stream after a reset */
+    int  (*set_init)(struct epd_s *e, const void *stream, size_t len);
+    /*
+     * optional, put a window of pixels into controller RAM, rows of buf
+     * stride bytes apart; on error the caller sends it as commands
+     */
+    int  (*upload)(struct epd_s *e, const unsigned char *buf, int stride,
+                   const struct epd_rect *r);
+    /* optional clock for BUSY timing, CLOCK_MONOTONIC when unset */
+    unsigned long long (*now_us)(struct epd_s *e);
+    void (*delay_us)(struct epd_s *e, unsigned long us);
+    void (*close)(struct epd_s *e);
+};
+
+/* allocate a handle for a backend; it fills in fd and priv */
+struct epd_s *epd_alloc(const struct epd_transport_ops *ops);
+
+#endif // EPAPER_TRANSPORT_H